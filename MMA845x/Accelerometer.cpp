@@ -3,9 +3,40 @@
 #include "TransientConfig.h"
 #include "Config.h"
 #include "I2C/I2C.h"
+#include "WarmStart/WarmStart.h"
+#include "avr/crc16.h"
 
 using namespace MMA845x;
 
+// Configuration last written to the device, kept across resets so Start()
+// can skip configuration if the device is already running with it. The 
+// device has two addresses (0x1c and 0x1d, set by SA0), so there is one 
+// snapshot for each. 
+struct AccelerometerWarmState
+{
+  uint8_t m_uI2CAddress;
+  uint16_t m_uConfigurationHash;
+};
+static WarmStart::Snapshot<AccelerometerWarmState> s_aWarmState[2] WARM_START_NOINIT;
+
+static WarmStart::Snapshot<AccelerometerWarmState> &WarmStateFor(uint8_t uI2CAddress)
+{
+  return s_aWarmState[uI2CAddress & 0x01];
+}
+
+// One CRC over each register address followed by its value, in the order 
+// they are written, then the control register 1 value. 
+static uint16_t ConfigurationHash(const uint8_t *pRegisterAddresses, const uint8_t *pRegisterValues, uint8_t uRegister1BaseValue, uint8_t uRegisters)
+{
+  uint16_t uCRC = 0x5a5a;
+  while (uRegisters--)
+  {
+    uCRC = _crc16_update(uCRC, *pRegisterAddresses++);
+    uCRC = _crc16_update(uCRC, *pRegisterValues++);
+  }
+  return _crc16_update(uCRC, uRegister1BaseValue);
+}
+
 Accelerometer::Accelerometer(uint8_t uI2CAddress /*= 0x1c*/) 
   : m_I2CAddr(uI2CAddress)
 {
@@ -30,6 +61,22 @@ bool Accelerometer::Start(const uint8_t *pRegisterAddresses, const uint8_t *pReg
   I2c.setSpeed(1);  // High speed (400 kHz).
   I2c.timeOut(10);  // Set timeout to recover from I2c bus lockup. [ms]
 
+  // Skip configuration if the device is still active with this configuration
+  // from before a reset. 
+  WarmStart::Snapshot<AccelerometerWarmState> &rWarmState = WarmStateFor(m_I2CAddr);
+  uint16_t uConfigurationHash = ConfigurationHash(pRegisterAddresses, pRegisterValues, uRegister1BaseValue, uRegisters);
+  if (rWarmState.IsValid() && rWarmState.m_Data.m_uI2CAddress == m_I2CAddr 
+    && rWarmState.m_Data.m_uConfigurationHash == uConfigurationHash)
+  {
+    uTest = 0;
+    if (I2c.read(m_I2CAddr, REG_CONTROL1, 1, &uTest) == 0 && uTest == (uRegister1BaseValue | CR1_ACTIVE))
+    {
+      m_State = STATE_Active;
+      return true;
+    }
+  }
+  rWarmState.Invalidate();
+
   // Write the configuration data out to the device. We assume that the
   // registers are in the correct order and that the first one places the
   // device in standby mode ready to be reconfigured. On some devices, 
@@ -45,7 +92,12 @@ bool Accelerometer::Start(const uint8_t *pRegisterAddresses, const uint8_t *pReg
 
   // Switch the device to active mode. 
   if (ReliableWrite(REG_CONTROL1, uRegister1BaseValue | CR1_ACTIVE))
+  {
     m_State = STATE_Active;
+    rWarmState.m_Data.m_uI2CAddress = m_I2CAddr;
+    rWarmState.m_Data.m_uConfigurationHash = uConfigurationHash;
+    rWarmState.Save();
+  }
   else
     m_State = STATE_Fault;
 
@@ -55,6 +107,7 @@ bool Accelerometer::Start(const uint8_t *pRegisterAddresses, const uint8_t *pReg
 void Accelerometer::Shutdown()
 {
   // Place device in sleep mode. 
+  WarmStateFor(m_I2CAddr).Invalidate();
   if (m_State != STATE_Off && ReliableWrite(REG_CONTROL1, 0))
     m_State = STATE_Off;
 }
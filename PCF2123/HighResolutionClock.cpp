@@ -0,0 +1,216 @@
+#include "HighResolutionClock.h"
+
+// Timer 1 runs from the cpu clock through this prescaler. 4us resolution on
+// a 16 MHz part, 8us on an 8 MHz part.
+#define HRC_TIMER_PRESCALER 64
+#define HRC_TIMER_CLOCK_SELECT (_BV(CS11) | _BV(CS10))
+#define HRC_CPU_MHZ (F_CPU / 1000000L)
+
+// Fraction bits in the microseconds per count factor. 
+#define HRC_SCALE_BITS 24
+
+static HighResolutionClock *s_pThis;
+
+// Upper 16 bits of the timer 1 count.
+static volatile uint16_t s_uTimerOverflows;
+
+#ifdef HRC_TIMER1_ISR
+ISR(TIMER1_OVF_vect)
+{
+  ++s_uTimerOverflows;
+}
+#endif
+
+HighResolutionClock::HighResolutionClock( RealTimeClock &rClock )
+  : m_rClock(rClock)
+{
+  m_uMicrosAtTick = 0;
+  m_uCountAtTick = 0;
+  m_uCountsPerTick = 0;
+  m_uMicrosPerCount = 0;
+  m_uLastResult = 0;
+}
+
+void HighResolutionClock::begin()
+{
+  uint8_t uSREG = SREG;
+  cli();
+
+  // Free running, normal mode.
+  TCCR1A = 0;
+  TCCR1B = HRC_TIMER_CLOCK_SELECT;
+  TCNT1 = 0;
+  TIFR1 = _BV(TOV1); // Clear any pending overflow.
+#ifdef HRC_TIMER1_ISR
+  TIMSK1 = _BV(TOIE1);
+#else
+  TIMSK1 = 0;
+#endif
+  s_uTimerOverflows = 0;
+
+  m_uMicrosAtTick = 0;
+  m_uCountAtTick = 0;
+  uint32_t uPeriod = m_rClock.GetTimerPeriodMicroseconds();
+  SetCountsPerTick(MicrosToCounts(uPeriod), uPeriod);
+  m_uLastResult = 0;
+
+  s_pThis = this;
+  m_rClock.SetTickCallback(TickHandler, ReadTimer);
+
+  SREG = uSREG;
+}
+
+uint64_t HighResolutionClock::GetMicroSeconds() const
+{
+  uint8_t uSREG = SREG;
+  cli();
+
+  uint32_t uNow = ReadTimer();
+  uint32_t uElapsed = uNow - m_uCountAtTick;
+  uint32_t uCountsPerTick = m_uCountsPerTick;
+  uint32_t uMicrosPerCount = m_uMicrosPerCount;
+  uint32_t uPeriod = m_rClock.GetTimerPeriodMicroseconds();
+
+  // Without RTC ticks nothing moves the base on, and the 32 bit count would
+  // wrap after 4.77 hours (at 16 MHz). Fold the elapsed time into the base
+  // well before then. 
+  if (uCountsPerTick == 0 && uElapsed >= 0x80000000UL)
+  {
+    m_uMicrosAtTick += CountsToMicros(uElapsed);
+    m_uCountAtTick = uNow;
+    uElapsed = 0;
+  }
+  uint64_t uBase = m_uMicrosAtTick;
+
+  SREG = uSREG;
+
+  uint64_t uOffset;
+  if (uCountsPerTick == 0 || uPeriod == 0)
+  {
+    // No RTC ticks to discipline us, or the period is too long to count in
+    // microseconds. Run from timer 1 alone.
+    uOffset = CountsToMicros(uElapsed);
+  }
+  else if (uElapsed >= uCountsPerTick)
+  {
+    // The tick is due. Never step past it, or time would go backwards when it arrives.
+    uOffset = uPeriod - 1;
+  }
+  else
+  {
+    // A multiply and shift; dividing here would be very slow on the AVR. 
+    uOffset = ((uint64_t)uElapsed * uMicrosPerCount) >> HRC_SCALE_BITS;
+  }
+
+  uint64_t uResult = uBase + uOffset;
+
+  // Another caller may have interrupted us since we sampled the clock. 
+  uSREG = SREG;
+  cli();
+  if (uResult < m_uLastResult)
+    uResult = m_uLastResult;
+  else
+    m_uLastResult = uResult;
+  SREG = uSREG;
+
+  return uResult;
+}
+
+void HighResolutionClock::TickHandler( uint32_t uCapture )
+{
+  // Interrupts are already off. uCapture is the timer 1 count when the RTC 
+  // interrupt arrived, which may have been a while ago if Service() ran it.
+  uint32_t uNow = uCapture;
+  uint32_t uPeriod = s_pThis->m_rClock.GetTimerPeriodMicroseconds();
+  uint32_t uNominal = MicrosToCounts(uPeriod);
+  uint32_t uMeasured = uNow - s_pThis->m_uCountAtTick;
+
+  // Timer 1 stops in deep sleep and the first period after a timer change is
+  // partial. Only trust measurements close to what we expect.
+  uint32_t uTolerance = uNominal >> 3;
+  if (uMeasured > uNominal - uTolerance && uMeasured < uNominal + uTolerance)
+    s_pThis->SetCountsPerTick(uMeasured, uPeriod);
+  else
+    s_pThis->SetCountsPerTick(uNominal, uPeriod);
+
+  if (uPeriod != 0)
+    s_pThis->m_uMicrosAtTick += uPeriod;
+  else // Period too long to count in microseconds.
+    s_pThis->m_uMicrosAtTick += (uint64_t)s_pThis->m_rClock.GetTimerPeriodMilliseconds() * 1000;
+  s_pThis->m_uCountAtTick = uNow;
+}
+
+void HighResolutionClock::SetCountsPerTick( uint32_t uCounts, uint32_t uPeriod )
+{
+  // Called with interrupts off. Works out uPeriod / uCounts with 
+  // HRC_SCALE_BITS fraction bits by long division, 8 bits at a time, so 
+  // it needs only 32 bit divides. 
+  m_uCountsPerTick = uCounts;
+  if (uCounts == 0)
+  {
+    m_uMicrosPerCount = 0;
+    return;
+  }
+
+  // Keep the shifted remainder in 32 bits. 
+  while (uCounts > 0xffffffUL)
+  {
+    uCounts >>= 1;
+    uPeriod >>= 1;
+  }
+
+  uint32_t uFactor = uPeriod / uCounts;
+  uint32_t uRemainder = uPeriod % uCounts;
+  for (uint8_t iStep = 0; iStep < HRC_SCALE_BITS / 8; ++iStep)
+  {
+    uRemainder <<= 8;
+    uFactor = (uFactor << 8) | (uRemainder / uCounts);
+    uRemainder %= uCounts;
+  }
+  m_uMicrosPerCount = uFactor;
+}
+
+uint32_t HighResolutionClock::ReadTimer()
+{
+  // Must be called with interrupts disabled.
+#ifdef HRC_TIMER1_ISR
+  uint16_t uOverflows = s_uTimerOverflows;
+  uint16_t uCount = TCNT1;
+
+  // An overflow may be pending that the interrupt hasn't counted yet. If the
+  // count is small, it happened before we read TCNT1.
+  if ((TIFR1 & _BV(TOV1)) && uCount < 0x8000)
+    ++uOverflows;
+#else
+  // Count the overflow here instead; at most one can have happened since 
+  // the last read. 
+  uint16_t uCount = TCNT1;
+  if (TIFR1 & _BV(TOV1))
+  {
+    uCount = TCNT1; // In case it overflowed after the first read. 
+    TIFR1 = _BV(TOV1);
+    ++s_uTimerOverflows;
+  }
+  uint16_t uOverflows = s_uTimerOverflows;
+#endif
+
+  return ((uint32_t)uOverflows << 16) | uCount;
+}
+
+uint32_t HighResolutionClock::MicrosToCounts( uint32_t uMicros )
+{
+  // Multiply first so the fraction of a count isn't lost (62500 us is 15625
+  // counts at 16 MHz). Only periods too long for that, over 268 s at 16 MHz,
+  // divide first. 
+  if (uMicros <= 0xffffffffUL / HRC_CPU_MHZ)
+    return uMicros * HRC_CPU_MHZ / HRC_TIMER_PRESCALER;
+  return uMicros / HRC_TIMER_PRESCALER * HRC_CPU_MHZ;
+}
+
+uint64_t HighResolutionClock::CountsToMicros( uint32_t uCounts )
+{
+  // Whole and part microseconds separately, so everything stays in 32 bits
+  // apart from the final shift. The constants make these shifts and masks.
+  return (uint64_t)(uCounts / HRC_CPU_MHZ) * HRC_TIMER_PRESCALER 
+    + (uCounts % HRC_CPU_MHZ) * HRC_TIMER_PRESCALER / HRC_CPU_MHZ;
+}
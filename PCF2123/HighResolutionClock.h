@@ -0,0 +1,56 @@
+/* *****************************************************************************
+*  Monotonic microsecond clock for time stamping events. The real time clock
+*  countdown timer provides the time base (it keeps running while the AVR
+*  sleeps). Timer 1 on the AVR interpolates between RTC ticks and is
+*  re-calibrated against the RTC on every tick.
+*
+*  Timer 1 overflows are counted by polling, so the clock must be read, or 
+*  the RTC must tick, at least every 262 ms (at 16 MHz). Define 
+*  HRC_TIMER1_ISR to count them from the timer 1 overflow interrupt instead;
+*  the library then owns TIMER1_OVF_vect, which Servo, TimerOne and the like
+*  also need. 
+*  ***************************************************************************** */
+#pragma once
+#include "Arduino.h"
+#include "RealTimeClock.h"
+
+class HighResolutionClock
+{
+public:
+  HighResolutionClock(RealTimeClock &rClock);
+
+  // Takes over timer 1 and starts listening for RTC ticks. The RTC timer
+  // period must be set (SetTimerPeriod) for the clock to be disciplined.
+  void begin();
+
+  // Microseconds since begin(). Never goes backwards.
+  uint64_t GetMicroSeconds() const;
+
+private:
+  static void TickHandler(uint32_t uCapture);
+  void SetCountsPerTick(uint32_t uCounts, uint32_t uPeriod);
+  static uint32_t ReadTimer();
+  static uint32_t MicrosToCounts(uint32_t uMicros);
+  static uint64_t CountsToMicros(uint32_t uCounts);
+
+  RealTimeClock &m_rClock;
+
+  // Microseconds at the last RTC tick.
+  mutable uint64_t volatile m_uMicrosAtTick;
+
+  // Extended timer 1 count captured at the last RTC tick.
+  mutable uint32_t volatile m_uCountAtTick;
+
+  // Timer 1 counts measured over the last RTC period. Zero if the RTC timer
+  // isn't running.
+  uint32_t volatile m_uCountsPerTick;
+
+  // Microseconds per timer 1 count over the last RTC period, in fixed 
+  // point (HRC_SCALE_BITS fraction bits). 
+  uint32_t volatile m_uMicrosPerCount;
+
+  // Last value returned. Used to keep the result monotonic when a period is
+  // shorter than the interpolation predicted. Only touched with interrupts
+  // off, as an interrupt handler may be reading the clock too.
+  mutable uint64_t m_uLastResult;
+};
@@ -1,5 +1,6 @@
 #include "RealTimeClock.h"
 #include "SPI/SPI.h"
+#include "../WarmStart/WarmStart.h"
 
 #define RTC_SUB_ADDRESS 0x10
 
@@ -20,17 +21,60 @@
 #define RTC_0E_TimerClkOut    (RTC_SUB_ADDRESS | 0x0E)
 #define RTC_0F_TimerCountDown (RTC_SUB_ADDRESS | 0x0F)
 
+#define RTC_CONTROL2_TIE 0x01   // Countdown timer interrupt enable
+#define RTC_CONTROL2_AIE 0x02   // Alarm interrupt enable
+#define RTC_CONTROL2_TF 0x04    // Countdown timer flag
+#define RTC_CONTROL2_AF 0x08    // Alarm flag
+#define RTC_CONTROL2_TI_TP 0x10 // Interrupt pin pulses rather than following flags
+#define RTC_CONTROL2_MSF 0x20   // Minute or second flag
+#define RTC_CONTROL2_SI 0x40    // Second interrupt enable
+#define RTC_CONTROL2_MI 0x80    // Minute interrupt enable
+
+// Flags are cleared by writing 0; writing 1 leaves them alone. 
+#define RTC_CONTROL2_FLAGS (RTC_CONTROL2_TF | RTC_CONTROL2_AF | RTC_CONTROL2_MSF)
+
+#define RTC_ALARM_DISABLE 0x80 // Alarm field is ignored when set. 
+
+#define RTC_SECONDS_OS_FLAG 0x80 // Oscillator stopped. Shares the seconds register. 
+
 #define RTC_TIMER_CLKOUT_NONE 0x70
 #define RTC_TIMER_TE_ENABLE 0x08
 #define RTC_TIMER_TE_DISABLE 0x00
 #define RTC_TIMER_SOURCE_4096Hz 0x00
 #define RTC_TIMER_SOURCE_64Hz 0x01
-#define RTC_TIMER_SOURCE_1Hz 0x10
-#define RTC_TIMER_SOURCE_60thHz 0x11
+#define RTC_TIMER_SOURCE_1Hz 0x02
+#define RTC_TIMER_SOURCE_60thHz 0x03
+#define RTC_TIMER_MAX_COUNT 255
+
+// Timer periods are worked out in 1/64ths of a microsecond so that the 
+// 4096 Hz source tick (244.140625 us) is exact. 
+#define RTC_PERIOD_UNITS_PER_US 64
+#define RTC_PERIOD_UNITS_PER_MS (1000UL * RTC_PERIOD_UNITS_PER_US)
 
 
 static RealTimeClock *s_pInterruptHandler;
 
+// Timer configuration kept across resets so begin() can pick up where we
+// left off if the chip is still running the same timer. 
+struct RTCWarmState
+{
+  uint8_t m_uTimerClkOut;
+  uint8_t m_uTimerCount;
+  uint32_t m_uInterruptPeriod;
+  uint16_t m_uInterruptPeriodFraction;
+  uint32_t m_uInterruptPeriodMicros;
+  uint32_t m_uMillisAtSave;
+  uint16_t m_uMillisFractionAtSave;
+  RTCTimeStamp m_uTimeAtSave;
+};
+static WarmStart::Snapshot<RTCWarmState> s_WarmState WARM_START_NOINIT;
+
+// Millis counter and its fraction at the last tick. They change too often
+// for a CRC, so they are checked against the complement of both combined. 
+static uint32_t s_uWarmMillis WARM_START_NOINIT;
+static uint16_t s_uWarmMillisFraction WARM_START_NOINIT;
+static uint32_t s_uWarmMillisCheck WARM_START_NOINIT;
+
 RealTimeClock::RealTimeClock( uint8_t uChipSelectPin, uint8_t uInterruptPin /*= NO_INTERRUPT*/ )
 #if F_CPU < 16000000L 
   : m_SPI(uChipSelectPin, SPI_CLOCK_DIV8, false, 0x80, 0x80, 0)
@@ -39,18 +83,36 @@ RealTimeClock::RealTimeClock( uint8_t uChipSelectPin, uint8_t uInterruptPin /*=
 #endif 
   , c_uInterruptPin(uInterruptPin)
 {
-
+  m_uInterruptPeriod = 0;
+  m_uInterruptPeriodFraction = 0;
+  m_uMillisFraction = 0;
+  m_uInterruptPeriodMicros = 0;
+  m_bFault = false;
+  m_pfnTickCallback = NULL;
+  m_pfnCapture = NULL;
+  m_uCapture = 0;
+  m_uControl2 = RTC_CONTROL2_TIE;
+  m_uTrigger = LOW;
+  m_bTimeCacheEnabled = false;
+  m_bTimeCacheValid = false;
+  m_uResyncInterval = 0;
+  m_bAlarmSignalled = false;
+  m_uPendingEvents = 0;
+  m_uTimerClkOut = RTC_TIMER_CLKOUT_NONE;
+  m_uTimerCount = 0;
+  m_bWarmStart = false;
 }
 
-bool RealTimeClock::begin()
+bool RealTimeClock::begin( uint8_t uTrigger /*= LOW*/ )
 {
-  m_SPI.Initialize();
+  m_SPI.Begin();
 
   // The seconds register contains a flag which indicates whether the 
   // clock is valid. If it is not valid, reset the device & restore time to zero. 
   uint8_t uSeconds;
 
   uSeconds = m_SPI.Read(RTC_02_Sec);
+  m_bWarmStart = false;
   if (uSeconds & 0x80)
   {
     // Clock integrity is not guaranteed. Oscillator has stopped or has been 
@@ -58,21 +120,31 @@ bool RealTimeClock::begin()
     m_SPI.Write(RTC_00_Control1, 0x58); // 0x58=>software reset.
     delay(40); // Give time for reset. 
   }
+  else if (s_WarmState.IsValid() && m_SPI.Read(RTC_0E_TimerClkOut) == s_WarmState.m_Data.m_uTimerClkOut)
+  {
+    // We've been reset but the clock hasn't. Carry on with the timer it's running. 
+    RestoreWarmState();
+  }
+
+  if (!m_bWarmStart)
+    s_WarmState.Invalidate();
 
-  // Hook up interrupts. 
+  // Hook up interrupts. The chip pulses the pin for edge triggering, and 
+  // holds it low until the flags are cleared for level triggering. 
   if (c_uInterruptPin != NO_INTERRUPT)
   {
     pinMode(c_uInterruptPin, INPUT_PULLUP); // RTC interrupt is open drain, active low. 
     uint8_t CurrentInterruptState = SREG; // Save interrupt state. 
     cli();  // disable interrupts. 
     s_pInterruptHandler = this;
-#ifdef digitalPinToInterrupt
-    attachInterrupt(digitalPinToInterrupt(m_SPI.m_uChipSelectPin), InterruptHandler, LOW);
-#else
-    attachInterrupt(2, InterruptHandler, LOW);
-#endif
-    m_SPI.Write(RTC_01_Control2, 0x01); // Interrupt from countdown timer. 
+    m_uTrigger = uTrigger == FALLING ? FALLING : LOW;
+    if (m_uTrigger == FALLING)
+      m_uControl2 |= RTC_CONTROL2_TI_TP;
+    else
+      m_uControl2 &= ~RTC_CONTROL2_TI_TP;
+    attachInterrupt(InterruptNumber(), InterruptHandler, m_uTrigger);
     SREG = CurrentInterruptState;
+    m_SPI.Write(RTC_01_Control2, m_uControl2); // Clears any old flags too. 
   }
 
   return true;
@@ -81,15 +153,41 @@ bool RealTimeClock::begin()
 void RealTimeClock::SetTime( const TimeData& Time )
 {
   m_SPI.BurstWrite(RTC_02_Sec,(const uint8_t*)&Time,sizeof(Time));
+  m_bTimeCacheValid = false;
 }
 
 void RealTimeClock::GetTime( TimeData& Time ) const
 {
-  m_SPI.BurstRead(RTC_02_Sec,(uint8_t*)&Time,sizeof(Time));
+  if (TimeCacheUsable())
+  {
+    if (!m_bTimeCacheValid)
+      ReloadTimeCache();
+
+    uint8_t CurIntReg = SREG;
+    cli();
+    Time = m_CachedTime;
+    SREG = CurIntReg;
+  }
+  else
+  {
+    m_SPI.BurstRead(RTC_02_Sec,(uint8_t*)&Time,sizeof(Time));
+  }
 }
 
 RTCTimeStamp RealTimeClock::GetTimeStamp() const
 {
+  if (TimeCacheUsable())
+  {
+    if (!m_bTimeCacheValid)
+      ReloadTimeCache();
+
+    uint8_t CurIntReg = SREG;
+    cli();
+    RTCTimeStamp uResult = m_uCachedTimeStamp;
+    SREG = CurIntReg;
+    return uResult;
+  }
+
   TimeData currentTime;
   memset(&currentTime,0,sizeof(currentTime));
   GetTime(currentTime);
@@ -97,49 +195,387 @@ RTCTimeStamp RealTimeClock::GetTimeStamp() const
   return currentTime.ToTimeStamp();
 }
 
-bool RealTimeClock::SetTimerPeriod( EWakePeriod64Hz Period )
+bool RealTimeClock::EnableTimeCache( uint16_t uResyncSeconds, bool bSecondInterrupt /*= false*/ )
 {
-  uint8_t uValue;
+  if (c_uInterruptPin == NO_INTERRUPT)
+    return false;
+
+  // The bus lock keeps the interrupt's flag handling out until Control2 is
+  // written; interrupts are only off while our copy changes. 
+  SharedSPI::CBusLock::Acquire();
   uint8_t CurIntReg = SREG;
+  cli();
+  m_uResyncInterval = uResyncSeconds;
+  m_bTimeCacheValid = false;
+  m_bTimeCacheEnabled = true;
+  if (bSecondInterrupt)
+    m_uControl2 |= RTC_CONTROL2_SI;
+  else
+    m_uControl2 &= ~RTC_CONTROL2_SI;
+  SREG = CurIntReg;
+  m_SPI.Write(RTC_01_Control2, m_uControl2 | RTC_CONTROL2_FLAGS); // Leave the flags for the handler. 
+  SharedSPI::CBusLock::Release();
 
+  return true;
+}
+
+void RealTimeClock::DisableTimeCache()
+{
+  SharedSPI::CBusLock::Acquire();
+  uint8_t CurIntReg = SREG;
+  cli();
+  m_bTimeCacheEnabled = false;
+  m_bTimeCacheValid = false;
+  bool bSecondInterrupt = (m_uControl2 & RTC_CONTROL2_SI) != 0;
+  m_uControl2 &= ~RTC_CONTROL2_SI;
+  SREG = CurIntReg;
+  if (bSecondInterrupt)
+    m_SPI.Write(RTC_01_Control2, m_uControl2 | RTC_CONTROL2_FLAGS);
+  SharedSPI::CBusLock::Release();
+}
+
+bool RealTimeClock::TimeCacheUsable() const
+{
+  if (!m_bTimeCacheEnabled)
+    return false;
+
+  // Without second interrupts, the cache can only be kept up to date if the 
+  // timer ticks at least once a second. 
+  return (m_uControl2 & RTC_CONTROL2_SI) != 0 
+    || (m_uInterruptPeriodMicros != 0 && m_uInterruptPeriodMicros <= 1000000UL);
+}
+
+void RealTimeClock::ReloadTimeCache() const
+{
+  // Read with interrupts on; the tick handler can advance the cache, so 
+  // only swap the new time in with them off. 
+  TimeData Time;
+  m_SPI.BurstRead(RTC_02_Sec,(uint8_t*)&Time,sizeof(Time));
+  Time.seconds &= ~RTC_SECONDS_OS_FLAG;
+  RTCTimeStamp uTimeStamp = Time.ToTimeStamp();
+
+  uint8_t CurIntReg = SREG;
+  cli();
+  m_CachedTime = Time;
+  m_uCachedTimeStamp = uTimeStamp;
+
+  // We don't know how far through the current second the chip is, so assume 
+  // it has just started. The cache may lag the chip by up to a second. 
+  m_uCacheMicros = 0;
+  m_uSecondsSinceSync = 0;
+  m_bTimeCacheValid = true;
+  SREG = CurIntReg;
+}
+
+void RealTimeClock::AdvanceTimeCache()
+{
+  // Called from the interrupt handler when a second has passed. 
+  if (!m_bTimeCacheValid)
+    return;
+
+  m_CachedTime.IncrementSecond();
+  ++m_uCachedTimeStamp;
+
+  ++m_uSecondsSinceSync;
+  if (m_uResyncInterval != 0 && m_uSecondsSinceSync >= m_uResyncInterval)
+    m_bTimeCacheValid = false; // Reload from the chip on next use. 
+}
+
+bool RealTimeClock::SetTimerPeriod( EWakePeriod64Hz Period )
+{
   if (m_bFault)
     return false;
 
   if (Period == WakeOff)
+    StopTimer();
+  else
+    StartTimer(RTC_TIMER_SOURCE_64Hz, Period);
+
+  return true;
+}
+
+bool RealTimeClock::SetTimerPeriodMicros( uint32_t uMicros, uint32_t *puAchievedMicros /*= NULL*/ )
+{
+  uint32_t uAchievedMillis = 0;
+  uint16_t uAchievedUnits = 0;
+
+  if (m_bFault)
+    return false;
+
+  if (uMicros == 0)
   {
     StopTimer();
-    return true; 
   }
   else
   {
-    cli();
+    // The longest period is 0xffffffff us. 
+    uint8_t uSource, uCount;
+    ChooseTimerSetting(uMicros / 1000, (uMicros % 1000) * RTC_PERIOD_UNITS_PER_US, 
+      0xffffffffUL / 1000, (0xffffffffUL % 1000) * RTC_PERIOD_UNITS_PER_US, uSource, uCount);
+    StartTimer(uSource, uCount);
+    GetTimerSettingPeriod(uSource, uCount, uAchievedMillis, uAchievedUnits);
+  }
+
+  if (puAchievedMicros != NULL)
+    *puAchievedMicros = uAchievedMillis * 1000 + (uAchievedUnits + RTC_PERIOD_UNITS_PER_US / 2) / RTC_PERIOD_UNITS_PER_US;
 
+  return true;
+}
+
+bool RealTimeClock::SetTimerPeriodMillis( uint32_t uMillis, uint32_t *puAchievedMillis /*= NULL*/ )
+{
+  uint32_t uAchievedMillis = 0;
+  uint16_t uAchievedUnits = 0;
+
+  if (m_bFault)
+    return false;
+
+  if (uMillis == 0)
+  {
+    StopTimer();
+  }
+  else
+  {
+    uint8_t uSource, uCount;
+    ChooseTimerSetting(uMillis, 0, 0xffffffffUL, 0, uSource, uCount);
+    StartTimer(uSource, uCount);
+    GetTimerSettingPeriod(uSource, uCount, uAchievedMillis, uAchievedUnits);
+  }
+
+  if (puAchievedMillis != NULL)
+    *puAchievedMillis = uAchievedMillis + (uAchievedUnits >= RTC_PERIOD_UNITS_PER_MS / 2 ? 1 : 0);
+
+  return true;
+}
+
+void RealTimeClock::ChooseTimerSetting( uint32_t uMillis, uint16_t uUnits, uint32_t uMaxMillis, uint16_t uMaxUnits, uint8_t &rSource, uint8_t &rCount )
+{
+  // Periods are whole milliseconds plus 1/64ths of a microsecond, so 
+  // everything stays in 32 bits. Try each source, fastest first. The fastest
+  // source wins a tie because the first period after starting the timer can
+  // be short by up to one source tick. 
+  bool bFound = false;
+  uint32_t uBestErrorMillis = 0;
+  uint16_t uBestErrorUnits = 0;
+
+  for (uint8_t uSource = RTC_TIMER_SOURCE_4096Hz; uSource <= RTC_TIMER_SOURCE_60thHz; ++uSource)
+  {
+    // Nearest count, rounding halves up. Anything past the maximum count 
+    // is clamped to it, so longer requests are cut off before multiplying. 
+    uint32_t uCount;
+    switch (uSource)
+    {
+    case RTC_TIMER_SOURCE_4096Hz: // 15625 units a tick. 
+      uCount = uMillis >= 64 ? RTC_TIMER_MAX_COUNT 
+        : (uMillis * RTC_PERIOD_UNITS_PER_MS + uUnits + 15625 / 2) / 15625;
+      break;
+    case RTC_TIMER_SOURCE_64Hz: // 15625 us a tick. 
+      uCount = uMillis >= 4096 ? RTC_TIMER_MAX_COUNT 
+        : (uMillis * 1000 + uUnits / RTC_PERIOD_UNITS_PER_US + 15625 / 2) / 15625;
+      break;
+    case RTC_TIMER_SOURCE_1Hz:
+      uCount = uMillis / 1000 + (uMillis % 1000 >= 500 ? 1 : 0);
+      break;
+    default:
+      uCount = uMillis / 60000 + (uMillis % 60000 >= 30000 ? 1 : 0);
+      break;
+    }
+    if (uCount < 1)
+      uCount = 1;
+    else if (uCount > RTC_TIMER_MAX_COUNT)
+      uCount = RTC_TIMER_MAX_COUNT;
+
+    uint32_t uCandidateMillis;
+    uint16_t uCandidateUnits;
+    GetTimerSettingPeriod(uSource, (uint8_t)uCount, uCandidateMillis, uCandidateUnits);
+    if (uCandidateMillis > uMaxMillis || (uCandidateMillis == uMaxMillis && uCandidateUnits > uMaxUnits))
+      continue;
+
+    // The difference, borrowing a millisecond when the units go negative. 
+    uint32_t uErrorMillis;
+    uint16_t uErrorUnits;
+    uint32_t uHighMillis = uCandidateMillis, uLowMillis = uMillis;
+    uint16_t uHighUnits = uCandidateUnits, uLowUnits = uUnits;
+    if (uCandidateMillis < uMillis || (uCandidateMillis == uMillis && uCandidateUnits < uUnits))
+    {
+      uHighMillis = uMillis;
+      uHighUnits = uUnits;
+      uLowMillis = uCandidateMillis;
+      uLowUnits = uCandidateUnits;
+    }
+    uErrorMillis = uHighMillis - uLowMillis;
+    if (uHighUnits >= uLowUnits)
+    {
+      uErrorUnits = uHighUnits - uLowUnits;
+    }
+    else
+    {
+      uErrorUnits = RTC_PERIOD_UNITS_PER_MS - (uLowUnits - uHighUnits);
+      --uErrorMillis;
+    }
+
+    if (!bFound || uErrorMillis < uBestErrorMillis 
+      || (uErrorMillis == uBestErrorMillis && uErrorUnits < uBestErrorUnits))
+    {
+      bFound = true;
+      uBestErrorMillis = uErrorMillis;
+      uBestErrorUnits = uErrorUnits;
+      rSource = uSource;
+      rCount = (uint8_t)uCount;
+    }
+
+    if (uErrorMillis == 0 && uErrorUnits == 0)
+      break; // Exact. Can't do better. 
+  }
+}
+
+void RealTimeClock::GetTimerSettingPeriod( uint8_t uSource, uint8_t uCount, uint32_t &ruMillis, uint16_t &ruUnits )
+{
+  // Whole milliseconds and the rest in 1/64ths of a microsecond. 
+  uint32_t uUnits = 0;
+  switch (uSource)
+  {
+  case RTC_TIMER_SOURCE_4096Hz:
+    uUnits = uCount * 15625UL; // At most 62.25 ms. 
+    ruMillis = uUnits / RTC_PERIOD_UNITS_PER_MS;
+    uUnits %= RTC_PERIOD_UNITS_PER_MS;
+    break;
+  case RTC_TIMER_SOURCE_64Hz:
+    {
+      uint32_t uMicros = uCount * 15625UL;
+      ruMillis = uMicros / 1000;
+      uUnits = (uMicros % 1000) * RTC_PERIOD_UNITS_PER_US;
+    }
+    break;
+  case RTC_TIMER_SOURCE_1Hz:
+    ruMillis = uCount * 1000UL;
+    break;
+  default:
+    ruMillis = uCount * 60000UL;
+    break;
+  }
+  ruUnits = (uint16_t)uUnits;
+}
+
+void RealTimeClock::StartTimer( uint8_t uSource, uint8_t uCount )
+{
+  uint8_t uValue;
+  SharedSPI::CBusLock::Acquire();
+
+  // Leave the timer alone if it's already running as we want (after a warm
+  // start, for example), so the tick keeps its phase. 
+  uValue = RTC_TIMER_CLKOUT_NONE | uSource | RTC_TIMER_TE_ENABLE;
+  bool bReprogram = uValue != m_uTimerClkOut || uCount != m_uTimerCount;
+
+  if (bReprogram)
+  {
     // First disable the timer so we can update without the risk of it generating an interrupt. 
-    uValue = RTC_TIMER_CLKOUT_NONE | RTC_TIMER_SOURCE_64Hz | RTC_TIMER_TE_DISABLE;
+    uValue = RTC_TIMER_CLKOUT_NONE | uSource | RTC_TIMER_TE_DISABLE;
     m_SPI.Write(RTC_0E_TimerClkOut, uValue);
 
     // Update the timer tick counter
-    m_SPI.Write(RTC_0F_TimerCountDown, Period);
-    m_uInterruptPeriod = ((uint32_t)Period * 1000) / 64;
+    m_SPI.Write(RTC_0F_TimerCountDown, uCount);
+  }
 
-    // Enable the timer again. 
-    uValue = RTC_TIMER_CLKOUT_NONE | RTC_TIMER_SOURCE_64Hz | RTC_TIMER_TE_ENABLE;
+  // Periods too long to count in microseconds (over about 71 minutes) 
+  // are reported in milliseconds only. The tick handler uses the period, 
+  // so switch to the new one with interrupts off. 
+  uint32_t uPeriod, uPeriodMicros;
+  uint16_t uPeriodFraction;
+  GetTimerSettingPeriod(uSource, uCount, uPeriod, uPeriodFraction);
+  if (uPeriod >= 0xffffffffUL / 1000)
+    uPeriodMicros = 0;
+  else
+    uPeriodMicros = uPeriod * 1000 
+      + (uPeriodFraction + RTC_PERIOD_UNITS_PER_US / 2) / RTC_PERIOD_UNITS_PER_US;
+
+  uint8_t CurIntReg = SREG;
+  cli();
+  m_uInterruptPeriod = uPeriod;
+  m_uInterruptPeriodFraction = uPeriodFraction;
+  m_uInterruptPeriodMicros = uPeriodMicros;
+  SREG = CurIntReg;
+
+  // Enable the timer again. 
+  uValue = RTC_TIMER_CLKOUT_NONE | uSource | RTC_TIMER_TE_ENABLE;
+  if (bReprogram)
     m_SPI.Write(RTC_0E_TimerClkOut, uValue);
+  m_uTimerClkOut = uValue;
+  m_uTimerCount = uCount;
 
-    SREG = CurIntReg;
+  SharedSPI::CBusLock::Release();
+
+  SaveWarmState();
+}
+
+void RealTimeClock::SaveWarmState()
+{
+  RTCTimeStamp uNow = GetTimeStamp();
+
+  uint8_t CurIntReg = SREG;
+  cli();
+  RTCWarmState &rState = s_WarmState.m_Data;
+  rState.m_uTimerClkOut = m_uTimerClkOut;
+  rState.m_uTimerCount = m_uTimerCount;
+  rState.m_uInterruptPeriod = m_uInterruptPeriod;
+  rState.m_uInterruptPeriodFraction = m_uInterruptPeriodFraction;
+  rState.m_uInterruptPeriodMicros = m_uInterruptPeriodMicros;
+  rState.m_uMillisAtSave = m_uMillisCounter;
+  rState.m_uMillisFractionAtSave = m_uMillisFraction;
+  rState.m_uTimeAtSave = uNow;
+  s_WarmState.Save();
+  s_uWarmMillis = m_uMillisCounter;
+  s_uWarmMillisFraction = m_uMillisFraction;
+  s_uWarmMillisCheck = ~(m_uMillisCounter ^ m_uMillisFraction);
+  SREG = CurIntReg;
+}
+
+void RealTimeClock::RestoreWarmState()
+{
+  const RTCWarmState &rState = s_WarmState.m_Data;
+  m_uTimerClkOut = rState.m_uTimerClkOut;
+  m_uTimerCount = rState.m_uTimerCount;
+  m_uInterruptPeriod = rState.m_uInterruptPeriod;
+  m_uInterruptPeriodFraction = rState.m_uInterruptPeriodFraction;
+  m_uInterruptPeriodMicros = rState.m_uInterruptPeriodMicros;
+
+  // Ticks are lost while we are in reset. Estimate the millis count from the
+  // clock's own time as well, and take whichever is later. 
+  uint32_t uMillis = rState.m_uMillisAtSave;
+  uint16_t uFraction = rState.m_uMillisFractionAtSave;
+  if (s_uWarmMillis == ~(s_uWarmMillisCheck ^ s_uWarmMillisFraction))
+  {
+    uMillis = s_uWarmMillis;
+    uFraction = s_uWarmMillisFraction;
   }
+  uint32_t uEstimate = rState.m_uMillisAtSave + (GetTimeStamp() - rState.m_uTimeAtSave) * 1000UL;
+  if ((int32_t)(uEstimate - uMillis) > 0)
+  {
+    uMillis = uEstimate;
+    uFraction = 0;
+  }
+  m_uMillisCounter = uMillis;
+  m_uMillisFraction = uFraction;
 
-  return true;
+  m_bWarmStart = true;
 }
 
 void RealTimeClock::StopTimer()
 {
+  SharedSPI::CBusLock::Acquire();
+  m_SPI.Write(RTC_0E_TimerClkOut, RTC_TIMER_CLKOUT_NONE);
+  m_SPI.Write(RTC_01_Control2, m_uControl2 | RTC_CONTROL2_AF | RTC_CONTROL2_MSF); // Clear timer signal flag. 
   uint8_t CurIntReg = SREG;
   cli();
-  m_SPI.Write(RTC_0E_TimerClkOut, RTC_TIMER_CLKOUT_NONE);
-  m_SPI.Write(RTC_01_Control2, 0x01); // Clear timer signal flag. 
   m_uInterruptPeriod = 0;
+  m_uInterruptPeriodFraction = 0;
+  m_uInterruptPeriodMicros = 0;
   SREG = CurIntReg;
+  m_uTimerClkOut = RTC_TIMER_CLKOUT_NONE;
+  m_uTimerCount = 0;
+  SharedSPI::CBusLock::Release();
+
+  SaveWarmState();
 }
 
 uint32_t RealTimeClock::GetMilliSeconds() volatile const
@@ -155,11 +591,256 @@ uint32_t RealTimeClock::GetMilliSeconds() volatile const
   return uResult;
 }
 
+void RealTimeClock::SetTickCallback( TickCallback pfnCallback, CaptureFunction pfnCapture /*= NULL*/ )
+{
+  uint8_t CurIntReg = SREG;
+  cli();
+  m_pfnTickCallback = pfnCallback;
+  m_pfnCapture = pfnCapture;
+  m_uCapture = 0;
+  SREG = CurIntReg;
+}
+
+bool RealTimeClock::SetAlarm( const TimeData &rAlarm )
+{
+  if (c_uInterruptPin == NO_INTERRUPT)
+    return false;
+
+  // Alarm registers: minute, hour, day, weekday. 
+  uint8_t auAlarm[4];
+  auAlarm[0] = rAlarm.minutes;
+  auAlarm[1] = rAlarm.hours;
+  auAlarm[2] = rAlarm.days;
+  auAlarm[3] = RTC_ALARM_DISABLE;
+
+  SharedSPI::CBusLock::Acquire();
+  m_SPI.BurstWrite(RTC_09_AlarmMin, auAlarm, sizeof(auAlarm));
+  uint8_t CurIntReg = SREG;
+  cli();
+  m_uControl2 |= RTC_CONTROL2_AIE;
+  m_bAlarmSignalled = false;
+  SREG = CurIntReg;
+  m_SPI.Write(RTC_01_Control2, m_uControl2 | RTC_CONTROL2_TF | RTC_CONTROL2_MSF); // Clear any old alarm. 
+  SharedSPI::CBusLock::Release();
+
+  return true;
+}
+
+void RealTimeClock::ClearAlarm()
+{
+  const uint8_t auAlarm[4] = { RTC_ALARM_DISABLE, RTC_ALARM_DISABLE, RTC_ALARM_DISABLE, RTC_ALARM_DISABLE };
+
+  SharedSPI::CBusLock::Acquire();
+  uint8_t CurIntReg = SREG;
+  cli();
+  m_uControl2 &= ~RTC_CONTROL2_AIE;
+  m_bAlarmSignalled = false;
+  SREG = CurIntReg;
+  m_SPI.Write(RTC_01_Control2, m_uControl2 | RTC_CONTROL2_TF | RTC_CONTROL2_MSF);
+  m_SPI.BurstWrite(RTC_09_AlarmMin, auAlarm, sizeof(auAlarm));
+  SharedSPI::CBusLock::Release();
+}
+
+bool RealTimeClock::CheckAlarm()
+{
+  uint8_t CurIntReg = SREG;
+  cli();
+  bool bResult = m_bAlarmSignalled;
+  m_bAlarmSignalled = false;
+  SREG = CurIntReg;
+  return bResult;
+}
+
+bool RealTimeClock::Service()
+{
+  uint8_t CurIntReg = SREG;
+  cli();
+  uint16_t uEvents = m_uPendingEvents;
+  m_uPendingEvents = 0;
+  uint32_t uCapture = m_uCapture;
+  SREG = CurIntReg;
+
+  if (uEvents == 0)
+    return false;
+
+  // With a level triggered interrupt, HandleFlags has already dealt with 
+  // each event. 
+  if (m_uTrigger == LOW)
+    return true;
+
+  // Find out what happened and clear the flags we saw. The alarm flag holds
+  // the interrupt pin low, so no more interrupts arrive until it is cleared. 
+  SharedSPI::CBusLock::Acquire();
+  uint8_t uFlags = m_SPI.Read(RTC_01_Control2);
+  m_SPI.Write(RTC_01_Control2, m_uControl2 | (RTC_CONTROL2_FLAGS & ~uFlags));
+  SharedSPI::CBusLock::Release();
+
+  // The flags don't say how many times each event happened, only that it did. 
+  // Alarms are rare, so count one interrupt for the alarm. 
+  if ((uFlags & RTC_CONTROL2_AF) && uEvents > 0)
+  {
+    m_bAlarmSignalled = true;
+    --uEvents;
+  }
+
+  // Without the timer flag, all the rest were seconds. With it, seconds and
+  // ticks share the count, but the chip's clock says how many seconds 
+  // passed: reload the cached time and see how far it moved. 
+  uint16_t uSeconds = 0;
+  bool bAdvanceCache = true;
+  if (uFlags & RTC_CONTROL2_MSF)
+  {
+    if (!(uFlags & RTC_CONTROL2_TF))
+    {
+      uSeconds = uEvents;
+    }
+    else
+    {
+      CurIntReg = SREG;
+      cli();
+      bool bWasValid = m_bTimeCacheValid;
+      RTCTimeStamp uBefore = m_uCachedTimeStamp;
+      SREG = CurIntReg;
+
+      ReloadTimeCache();
+      uint32_t uMoved = m_uCachedTimeStamp - uBefore;
+      if (!bWasValid) // Nothing to compare with. Assume one. 
+        uMoved = 1;
+      uSeconds = uMoved < uEvents ? uMoved : uEvents;
+      bAdvanceCache = false;
+    }
+  }
+  uEvents -= uSeconds;
+  while (bAdvanceCache && uSeconds--)
+  {
+    CurIntReg = SREG;
+    cli();
+    if (m_bTimeCacheEnabled)
+      AdvanceTimeCache();
+    SREG = CurIntReg;
+  }
+
+  // Only the latest interrupt's capture is kept, so ticks applied together
+  // all get it. 
+  if (uFlags & RTC_CONTROL2_TF)
+  {
+    if (uEvents == 0)
+      uEvents = 1;
+    while (uEvents--)
+    {
+      CurIntReg = SREG;
+      cli();
+      ApplyTick(uCapture);
+      SREG = CurIntReg;
+    }
+  }
+
+  return true;
+}
+
+void RealTimeClock::ApplyTick( uint32_t uCapture )
+{
+  // Must be called with interrupts disabled. 
+
+  // Update current time. The part of a millisecond left over from each 
+  // tick is carried, so periods that aren't whole milliseconds don't drift.
+  m_uMillisCounter += m_uInterruptPeriod;
+  if (m_uMillisFraction >= RTC_PERIOD_UNITS_PER_MS - m_uInterruptPeriodFraction)
+  {
+    m_uMillisFraction -= RTC_PERIOD_UNITS_PER_MS - m_uInterruptPeriodFraction;
+    ++m_uMillisCounter;
+  }
+  else
+    m_uMillisFraction += m_uInterruptPeriodFraction;
+  s_uWarmMillis = m_uMillisCounter;
+  s_uWarmMillisFraction = m_uMillisFraction;
+  s_uWarmMillisCheck = ~(m_uMillisCounter ^ m_uMillisFraction);
+
+  // Let listeners know as early as possible so they see the tick with minimal latency. 
+  if (m_pfnTickCallback != NULL)
+    m_pfnTickCallback(uCapture);
+
+  if (!(m_uControl2 & RTC_CONTROL2_SI) && TimeCacheUsable())
+  {
+    m_uCacheMicros += m_uInterruptPeriodMicros;
+    while (m_uCacheMicros >= 1000000UL)
+    {
+      m_uCacheMicros -= 1000000UL;
+      AdvanceTimeCache();
+    }
+  }
+}
+
 void RealTimeClock::InterruptHandler()
 {
-  // Update current time. 
-  s_pInterruptHandler->m_uMillisCounter += s_pInterruptHandler->m_uInterruptPeriod;
+  // No bus traffic here: the handler could interrupt another driver part way 
+  // through a transfer. In pulse mode, the timer doesn't need its flag cleared
+  // before the next tick. 
+  RealTimeClock *pThis = s_pInterruptHandler;
+
+  uint32_t uCapture = 0;
+  if (pThis->m_pfnCapture != NULL)
+    uCapture = pThis->m_pfnCapture();
+
+  if (pThis->m_uTrigger == LOW)
+  {
+    // The chip holds the pin low until its flags are cleared. Mask the 
+    // interrupt until HandleFlags has done that. 
+    detachInterrupt(pThis->InterruptNumber());
+    pThis->m_uCapture = uCapture;
+    HandleFlags();
+  }
+  else if (pThis->m_uControl2 & (RTC_CONTROL2_SI | RTC_CONTROL2_AIE))
+  {
+    // Several events share the pin. Service() reads the chip to sort them out. 
+    pThis->m_uCapture = uCapture;
+    if (pThis->m_uPendingEvents < 0xffff)
+      ++pThis->m_uPendingEvents;
+  }
+  else
+  {
+    pThis->ApplyTick(uCapture);
+  }
+}
+
+void RealTimeClock::HandleFlags()
+{
+  // Reads and clears the chip's flags for the level triggered interrupt, 
+  // then unmasks it. Only runs with the bus free, so it never breaks into 
+  // another driver's transfer; otherwise the bus lock calls it back when the
+  // bus is released. 
+  if (!SharedSPI::CBusLock::TryAcquire())
+  {
+    SharedSPI::CBusLock::Defer(HandleFlags);
+    return;
+  }
+
+  RealTimeClock *pThis = s_pInterruptHandler;
+  uint8_t uFlags = pThis->m_SPI.Read(RTC_01_Control2);
+  pThis->m_SPI.Write(RTC_01_Control2, pThis->m_uControl2 | (RTC_CONTROL2_FLAGS & ~uFlags));
+
+  // Each event holds the pin until cleared, so each flag is one event. 
+  uint8_t CurIntReg = SREG;
+  cli();
+  if (uFlags & RTC_CONTROL2_TF)
+    pThis->ApplyTick(pThis->m_uCapture);
+  if ((uFlags & RTC_CONTROL2_MSF) && pThis->m_bTimeCacheEnabled)
+    pThis->AdvanceTimeCache();
+  if (uFlags & RTC_CONTROL2_AF)
+    pThis->m_bAlarmSignalled = true;
+  if (pThis->m_uPendingEvents < 0xffff)
+    ++pThis->m_uPendingEvents;
+  attachInterrupt(pThis->InterruptNumber(), InterruptHandler, LOW);
+  SREG = CurIntReg;
+
+  SharedSPI::CBusLock::Release();
+}
 
-  // Clear timer interrupt flag. 
-  s_pInterruptHandler->m_SPI.Write(RTC_01_Control2, 0x01);
+uint8_t RealTimeClock::InterruptNumber() const
+{
+#ifdef digitalPinToInterrupt
+  return digitalPinToInterrupt(c_uInterruptPin);
+#else
+  return 2;
+#endif
 }
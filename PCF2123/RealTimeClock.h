@@ -9,6 +9,18 @@
 
 class RealTimeClock
 {
+public:
+  // Function called on each tick of the RTC timer, from the interrupt handler
+  // or, when the alarm or seconds interrupts share the pin, from Service(). 
+  // Runs with interrupts disabled so it must be short. uCapture is what the
+  // capture function returned when the interrupt arrived, so it doesn't 
+  // depend on when Service() gets called. 
+  typedef void (*TickCallback)(uint32_t uCapture);
+
+  // Called by the interrupt handler on every interrupt, with interrupts
+  // disabled. Typically reads a free running timer. 
+  typedef uint32_t (*CaptureFunction)();
+
 private:
   SharedSPI::CSharedSPI m_SPI;
 
@@ -16,11 +28,46 @@ private:
 
   // A millis count based off the real time clock interrupts. The normal Arduino
   // RTC loses time when the arduino sleeps.
-  uint32_t volatile m_uMillisCounter; // Current millis count. Based off RTC timer. Granularity is m_uInterruptPeriod. 
+  uint32_t volatile m_uMillisCounter; // Current millis count. Based off RTC timer. 
 
-  uint32_t m_uInterruptPeriod; // Number of milliseconds between each tick of the RTC timer.
+  uint32_t m_uInterruptPeriod; // Number of whole milliseconds between each tick of the RTC timer.
+  uint16_t m_uInterruptPeriodFraction; // and the rest, in 1/64ths of a microsecond. 
+  uint16_t m_uMillisFraction; // Part of a millisecond not yet added to the millis count, in 1/64 us. 
+  uint32_t m_uInterruptPeriodMicros; // Number of microseconds between each tick of the RTC timer. 
 
   bool m_bFault; // True if a fault is detected. 
+
+  TickCallback m_pfnTickCallback; // Called on each timer tick, if not NULL. 
+  CaptureFunction m_pfnCapture; // Called on each interrupt, if not NULL. 
+  uint32_t volatile m_uCapture; // From m_pfnCapture at the last interrupt. 
+
+  uint8_t m_uControl2; // Interrupt enable bits for control register 2. 
+
+  // Copy of the chip's time, advanced by the interrupt handler, so the time can be 
+  // read without talking to the chip. Reloaded from the chip when not valid. 
+  bool m_bTimeCacheEnabled;
+  mutable bool volatile m_bTimeCacheValid;
+  mutable TimeData m_CachedTime;
+  mutable RTCTimeStamp m_uCachedTimeStamp;
+  mutable uint32_t m_uCacheMicros; // Time since the cached second started. 
+  mutable uint16_t m_uSecondsSinceSync; 
+  uint16_t m_uResyncInterval; // Seconds between reloads from the chip. 0 => never. 
+
+  bool volatile m_bAlarmSignalled; // Set by Service() when the alarm goes off. 
+
+  // Interrupts since the last Service(). For edge triggering with more 
+  // than the timer interrupting, they wait there to be sorted out. 
+  // Saturates at 0xffff. 
+  uint16_t volatile m_uPendingEvents;
+
+  uint8_t m_uTrigger; // LOW or FALLING. 
+
+  // Timer settings last written to the chip. 
+  uint8_t m_uTimerClkOut;
+  uint8_t m_uTimerCount;
+
+  bool m_bWarmStart; // True if begin() found the clock already running our timer. 
+
 public:
   enum EConstants { NO_INTERRUPT = 0xff };
 
@@ -45,19 +92,83 @@ public:
   } PACKED;
 
   RealTimeClock(uint8_t uChipSelectPin, uint8_t uInterruptPin = NO_INTERRUPT);
-  bool begin();
+
+  // After a reset where the clock kept running (watchdog, brown-out, reset 
+  // button), begin() restores the timer settings and millis count saved
+  // before the reset instead of starting again. 
+  //
+  // uTrigger is LOW or FALLING. LOW (the default) is the only one that wakes
+  // the AVR from power-down or power-save. The chip holds the pin low until 
+  // its flags are cleared, so the handler masks the interrupt and clears 
+  // them over SPI, but only once the bus is free (see CBusLock::Defer); each
+  // event is then handled as it happens. With FALLING the chip pulses the
+  // pin and the handler never uses the bus, but edges only wake the AVR 
+  // from idle, and alarms or seconds sharing the pin need Service(). 
+  bool begin(uint8_t uTrigger = LOW);
+  bool WasWarmStart() const { return m_bWarmStart; }
 
   void SetTime(const TimeData& Time);
   void GetTime(TimeData& Time) const;
   RTCTimeStamp GetTimeStamp() const;
 
+  // Returns true if there were any interrupts since the last call. With a 
+  // level triggered interrupt, or just the timer interrupting, the events
+  // have already been handled. With an edge triggered interrupt and second
+  // or alarm interrupts enabled too, the handler only records that 
+  // something happened; call Service() from the main loop to read and clear
+  // the chip's flags and handle the events. When both seconds and ticks 
+  // arrived, the cached time is reloaded from the chip to tell them apart. 
+  bool Service();
+
+  // Keep a copy of the time in RAM so GetTime and GetTimeStamp don't need to read
+  // the chip. The copy is reloaded from the chip every uResyncSeconds (0 => only when 
+  // needed). With bSecondInterrupt, the chip's once-a-second interrupt advances the
+  // copy so it changes with the chip's seconds (needs Service()). Otherwise the timer advances it, which 
+  // needs a timer period of one second or less, and the copy may lag the chip by up 
+  // to a second. Requires the interrupt pin. 
+  bool EnableTimeCache(uint16_t uResyncSeconds, bool bSecondInterrupt = false);
+  void DisableTimeCache();
+
   bool SetTimerPeriod(EWakePeriod64Hz Period);
+
+  // Set the timer to the period closest to that requested, choosing from the 
+  // 4096 Hz (244us to 62ms), 64 Hz (15.6ms to 4s), 1 Hz (1s to 255s) and 1/60 Hz
+  // (1 minute to 255 minutes) sources. Exact periods are used when available. 
+  // The period achieved is returned through the last parameter, if not NULL. 
+  // A period of zero stops the timer. 
+  bool SetTimerPeriodMicros(uint32_t uMicros, uint32_t *puAchievedMicros = NULL);
+  bool SetTimerPeriodMillis(uint32_t uMillis, uint32_t *puAchievedMillis = NULL);
   void StopTimer();
   uint32_t GetMilliSeconds() volatile const;
   uint32_t GetTimerPeriodMilliseconds() const { return m_uInterruptPeriod; }
+  uint32_t GetTimerPeriodMicroseconds() const { return m_uInterruptPeriodMicros; } // 0 if too long to represent. 
+
+  void SetTickCallback(TickCallback pfnCallback, CaptureFunction pfnCapture = NULL);
+
+  // The alarm goes off when the minute, hour and day of the month match rAlarm
+  // (seconds and weekday are ignored). Requires the interrupt pin. 
+  bool SetAlarm(const TimeData &rAlarm);
+  void ClearAlarm();
+
+  // True if the alarm has gone off since the last call. Alarms are picked 
+  // up by Service(). 
+  bool CheckAlarm();
 
 private:
   static void InterruptHandler();
+  static void HandleFlags();
+  uint8_t InterruptNumber() const;
+  void ApplyTick(uint32_t uCapture);
+  void SaveWarmState();
+  void RestoreWarmState();
+
+  bool TimeCacheUsable() const;
+  void ReloadTimeCache() const;
+  void AdvanceTimeCache();
+
+  void StartTimer(uint8_t uSource, uint8_t uCount);
+  static void ChooseTimerSetting(uint32_t uMillis, uint16_t uUnits, uint32_t uMaxMillis, uint16_t uMaxUnits, uint8_t &rSource, uint8_t &rCount);
+  static void GetTimerSettingPeriod(uint8_t uSource, uint8_t uCount, uint32_t &ruMillis, uint16_t &ruUnits);
 
 
 };
\ No newline at end of file
@@ -1,61 +1,231 @@
 #include "TimeData.h"
 
 
+// Days in the year before the start of each month (non-leap year). 
+static const uint16_t c_auDaysBeforeMonth[12] PROGMEM = 
+  { 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+
+#define SECONDS_PER_DAY 86400UL
+#define DAYS_PER_FOUR_YEARS 1461 
+#define EPOCH_WEEKDAY 6 // 2000-01-01 was a Saturday. 
+
+// The AVR has no divide instruction and 32-bit division is slow, so 
+// division by constants is done by multiplying by a scaled reciprocal 
+// and shifting. Each is exact over the range noted. 
+
+static uint16_t DaysFromSeconds( uint32_t uSeconds )
+{
+  // Estimate is low by at most one day for any 32-bit value.
+  uint16_t uDays = ((uSeconds >> 15) * 24855UL) >> 16;
+  if (uSeconds - uDays * SECONDS_PER_DAY >= SECONDS_PER_DAY)
+    ++uDays;
+  return uDays;
+}
+
+static uint8_t HoursFromSeconds( uint32_t uSeconds )
+{
+  // uSeconds / 3600 for uSeconds < 86400.
+  return ((uSeconds >> 4) * 4661UL) >> 20;
+}
+
+static uint8_t MinutesFromSeconds( uint16_t uSeconds )
+{
+  // uSeconds / 60 for uSeconds < 3600.
+  return ((uint32_t)uSeconds * 2185UL) >> 17;
+}
+
+static uint16_t FourYearsFromDays( uint16_t uDays )
+{
+  // uDays / 1461 for any uint16_t.
+  return ((uint32_t)uDays * 22967UL) >> 25;
+}
+
+static uint8_t WeekdayFromDays( uint16_t uDays )
+{
+  // (uDays + 6) % 7. 
+  uint32_t uShifted = (uint32_t)uDays + EPOCH_WEEKDAY;
+  uint16_t uWeeks = (uShifted * 74899UL) >> 19;
+  return uShifted - uWeeks * 7;
+}
+
 void TimeData::InitalizeFrom( RTCTimeStamp uTimestamp )
 {
-  // Probably smaller. 
-  years = uTimestamp / (13UL * 32UL * 24UL * 60UL * 60UL);
-  uTimestamp -= years * (13UL * 32UL * 24UL * 60UL * 60UL);
-  months = uTimestamp / (32UL * 24UL * 60UL * 60UL);
-  uTimestamp -= months * (32UL * 24UL * 60UL * 60UL);
-  days = uTimestamp / (24UL * 60UL * 60UL);
-  uTimestamp -= days * (24UL * 60UL * 60UL);
-  hours = uTimestamp / (60UL * 60UL);
-  uTimestamp -= hours * (60UL * 60UL);
-  minutes = uTimestamp / (60UL);
-  uTimestamp -= minutes * (60UL);
-  seconds = uTimestamp;
-
-  // Everything needs to be converted to BCD. 
-  // A hack to save save program memory. 
-  uint8_t *pConvert;
-  uint8_t iConvert;
-
-  pConvert = (uint8_t*)this;
-  for (iConvert = 0; iConvert < 7; ++iConvert)
+  uint16_t uDays = DaysFromSeconds(uTimestamp);
+  uint32_t uSecondOfDay = uTimestamp - uDays * SECONDS_PER_DAY;
+
+  uint8_t uHours = HoursFromSeconds(uSecondOfDay);
+  uint16_t uSecondOfHour = uSecondOfDay - uHours * 3600U;
+  uint8_t uMinutes = MinutesFromSeconds(uSecondOfHour);
+  uint8_t uSeconds = uSecondOfHour - uMinutes * 60U;
+
+  weekdays = WeekdayFromDays(uDays);
+
+  // Every fourth year is a leap year, starting with 2000. 2100 isn't, but
+  // the clock only counts to 2099. 
+  uint16_t uFourYears = FourYearsFromDays(uDays);
+  uint16_t uDayOfYear = uDays - uFourYears * DAYS_PER_FOUR_YEARS;
+  uint8_t uYear = uFourYears * 4;
+  bool bLeapYear = true;
+  if (uDayOfYear >= 366)
   {
-    *pConvert = Decimal2BCD(*pConvert);
-    ++pConvert;
+    uDayOfYear -= 366;
+    ++uYear;
+    bLeapYear = false;
+    while (uDayOfYear >= 365)
+    {
+      uDayOfYear -= 365;
+      ++uYear;
+    }
   }
-  weekdays = 0; // assumed. the RTC data sheet says the meaning can be assigned by user.
+
+  uint8_t uMonth = 12;
+  uint16_t uMonthStart;
+  do 
+  {
+    --uMonth;
+    uMonthStart = pgm_read_word(&c_auDaysBeforeMonth[uMonth]);
+    if (bLeapYear && uMonth >= 2)
+      ++uMonthStart;
+  } while (uDayOfYear < uMonthStart);
+
+  while (uYear >= 100)
+    uYear -= 100;
+
+  seconds = Decimal2BCD(uSeconds);
+  minutes = Decimal2BCD(uMinutes);
+  hours = Decimal2BCD(uHours);
+  days = Decimal2BCD(uDayOfYear - uMonthStart + 1);
+  months = Decimal2BCD(uMonth + 1);
+  years = Decimal2BCD(uYear);
 }
 
 RTCTimeStamp TimeData::ToTimeStamp() const
 {
-  uint8_t *pData;
-  uint8_t uElement;
-  uint32_t uDecimalValue;
-  uint32_t aScale[] = {1, 60, 60*60, 24UL*60UL*60UL, 0, 32UL*24UL*60UL*60UL, 13UL*32UL*24UL*60UL*60UL};
-  uint32_t uResult;
-  uint32_t *pScale;
-
-  pData = (uint8_t*)this;
-  pScale = aScale;
-  uElement = 7;
-  uResult = 0;
-  while(uElement--)
+  uint8_t uYear = BCD2Decimal(years);
+  uint8_t uMonth = BCD2Decimal(months) - 1;
+
+  // Days to the start of the year, including a leap day for 
+  // each leap year before this one. 
+  uint16_t uDays = uYear * 365U + ((uYear + 3) >> 2);
+  uDays += pgm_read_word(&c_auDaysBeforeMonth[uMonth]);
+  if (uMonth >= 2 && (uYear & 0x03) == 0)
+    ++uDays;
+  uDays += BCD2Decimal(days) - 1;
+
+  uint32_t uResult = uDays * SECONDS_PER_DAY;
+  uResult += (uint32_t)BCD2Decimal(hours) * 3600UL; // Overflows 16 bits from 19:00. 
+  uResult += (uint32_t)BCD2Decimal(minutes) * 60UL;
+  uResult += BCD2Decimal(seconds & 0x7f); // Top bit of seconds is the clock's oscillator stopped flag. 
+
+  return uResult;
+}
+
+void TimeData::AddSeconds( uint32_t uSeconds )
+{
+  // Cheap when we stay within the current hour. Otherwise go via the time stamp. 
+  uint32_t uSecondOfHour = BCD2Decimal(minutes) * 60U + BCD2Decimal(seconds & 0x7f) + uSeconds;
+  if (uSecondOfHour < 3600)
+  {
+    uint8_t uMinutes = MinutesFromSeconds(uSecondOfHour);
+    minutes = Decimal2BCD(uMinutes);
+    seconds = Decimal2BCD(uSecondOfHour - uMinutes * 60U);
+  }
+  else
   {
-    uDecimalValue = BCD2Decimal(*pData++);
-    uDecimalValue *= *pScale++;
-    uResult += uDecimalValue;
+    InitalizeFrom(ToTimeStamp() + uSeconds);
   }
+}
 
-  return uResult;
+int8_t TimeData::Compare( const TimeData &rOther ) const
+{
+  // BCD values sort the same way as the decimal values they hold. 
+  const uint8_t auThis[] = { years, months, days, hours, minutes, (uint8_t)(seconds & 0x7f) };
+  const uint8_t auOther[] = { rOther.years, rOther.months, rOther.days, rOther.hours, rOther.minutes, (uint8_t)(rOther.seconds & 0x7f) };
+  for (uint8_t iField = 0; iField < sizeof(auThis); ++iField)
+  {
+    if (auThis[iField] != auOther[iField])
+      return auThis[iField] < auOther[iField] ? -1 : 1;
+  }
+  return 0;
+}
+
+int32_t TimeData::SecondsSince( const TimeData &rEarlier ) const
+{
+  return (int32_t)(ToTimeStamp() - rEarlier.ToTimeStamp());
+}
+
+bool TimeData::IncrementSecond()
+{
+  // Work directly in BCD. Each field rolls over into the next. 
+  seconds = IncrementBCD(seconds);
+  if (seconds < 0x60)
+    return false;
+  seconds = 0;
+
+  minutes = IncrementBCD(minutes);
+  if (minutes < 0x60)
+    return false;
+  minutes = 0;
+
+  hours = IncrementBCD(hours);
+  if (hours < 0x24)
+    return false;
+  hours = 0;
+
+  weekdays = weekdays >= 6 ? 0 : weekdays + 1;
+  days = IncrementBCD(days);
+  if (days <= DaysInMonthBCD(months, years))
+    return true;
+  days = 1;
+
+  months = IncrementBCD(months);
+  if (months <= 0x12)
+    return true;
+  months = 1;
+
+  years = years == 0x99 ? 0 : IncrementBCD(years);
+  return true;
+}
+
+uint8_t IncrementBCD( uint8_t uBCDValue )
+{
+  // Carry into the tens digit when the units reach 10. 
+  ++uBCDValue;
+  if ((uBCDValue & 0x0f) == 0x0a)
+    uBCDValue += 0x06;
+  return uBCDValue;
+}
+
+uint8_t DaysInMonthBCD( uint8_t uMonth, uint8_t uYear )
+{
+  // Month and year are BCD; so is the result. Years are 2000-2099, so every 
+  // fourth year is a leap year. A BCD year is divisible by 4 when the tens 
+  // digit is even and the units are 0, 4 or 8, or the tens digit is odd
+  // and the units are 2 or 6. 
+  switch (uMonth)
+  {
+  case 0x02:
+    {
+      uint8_t uUnits = uYear & 0x0f;
+      bool bLeap = (uYear & 0x10) ? (uUnits == 2 || uUnits == 6) 
+        : (uUnits == 0 || uUnits == 4 || uUnits == 8);
+      return bLeap ? 0x29 : 0x28;
+    }
+  case 0x04:
+  case 0x06:
+  case 0x09:
+  case 0x11:
+    return 0x30;
+  default:
+    return 0x31;
+  }
 }
 
 uint8_t Decimal2BCD( uint8_t uDecimalValue )
 {
-  return ((uDecimalValue / 10) << 4) | (uDecimalValue % 10);
+  // uDecimalValue / 10 for values below 100, without dividing. 
+  uint8_t uTens = ((uint16_t)uDecimalValue * 205U) >> 11;
+  return (uTens << 4) | (uDecimalValue - uTens * 10);
 }
 
 uint8_t BCD2Decimal( uint8_t uBDCValue )
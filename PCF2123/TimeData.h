@@ -5,8 +5,12 @@
 #pragma once
 #include "Arduino.h"
 
+// Seconds since 2000-01-01 00:00:00. 
 typedef uint32_t RTCTimeStamp;
 
+// Add to an RTCTimeStamp to get Unix time (seconds since 1970-01-01). 
+#define RTC_UNIX_EPOCH_OFFSET 946684800UL
+
 struct TimeData
 {
   // Time is stored in BCD format. 
@@ -18,14 +22,39 @@ struct TimeData
   uint8_t months;  // [1,12]
   uint8_t years;   // [0,99]
 
+  // Conversion to and from time stamps. Valid from 2000 to 2099. 
   void InitalizeFrom(RTCTimeStamp uTimestamp);
   RTCTimeStamp ToTimeStamp() const;
 
+  void AddSeconds(uint32_t uSeconds);
+
+  // Returns -1, 0 or 1 as this time is before, the same as or after rOther. 
+  int8_t Compare(const TimeData &rOther) const;
+
+  // Seconds from rEarlier to this time. Negative if rEarlier is actually later. 
+  int32_t SecondsSince(const TimeData &rEarlier) const;
+
+  // Advances the time by one second, following the calendar. Returns 
+  // true if the date changed. 
+  bool IncrementSecond();
+
 } __attribute__((__packed__));
 
 
 uint8_t Decimal2BCD(uint8_t uDecimalValue);
 uint8_t BCD2Decimal(uint8_t uBDCValue);
+uint8_t IncrementBCD(uint8_t uBCDValue);
+uint8_t DaysInMonthBCD(uint8_t uMonth, uint8_t uYear);
+
+#ifdef TIMEDATA_MEASURE
+// Define TIMEDATA_MEASURE to build a check of the time stamp conversions and
+// a benchmark of them against the old division based versions. Run both on
+// the target: int is 16 bits there, which is where products like 
+// hours * 3600 overflow, and divides are done in software. The check 
+// returns false and prints the first mismatch on failure. 
+bool CheckTimeDataConversions(Print &rOut);
+void RunTimeDataBenchmark(Print &rOut, uint16_t uIterations = 1000);
+#endif
 
 void PrintDateTime(const TimeData &Time, Print& rDestination = Serial);
 void PrintDate(const TimeData &Time, Print& rDestination = Serial);
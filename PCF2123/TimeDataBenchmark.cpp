@@ -0,0 +1,189 @@
+/* *****************************************************************************
+*  Check and benchmark for the TimeData time stamp conversions. Only built
+*  when TIMEDATA_MEASURE is defined.
+*  ***************************************************************************** */
+#include "TimeData.h"
+
+#ifdef TIMEDATA_MEASURE
+
+#if __INT_MAX__ != 32767
+#warning "int is wider than 16 bits here, so the check can't catch 16-bit overflows. Run it on the AVR."
+#endif
+
+// Dates checked at every minute of every hour: the first day, leap
+// days, year ends and the last day the clock can hold. BCD year, month, day.
+static const uint8_t c_auCheckDates[][3] PROGMEM =
+{
+  { 0x00, 0x01, 0x01 }, { 0x00, 0x02, 0x29 }, { 0x00, 0x12, 0x31 },
+  { 0x23, 0x03, 0x01 }, { 0x24, 0x02, 0x29 }, { 0x99, 0x12, 0x31 },
+};
+
+static const uint8_t c_auCheckSeconds[] = { 0, 1, 30, 59 };
+
+// Seconds since 2000 worked out the slow way, all in 32 bits.
+static uint32_t ReferenceTimeStamp( uint8_t uYear, uint8_t uMonth, uint8_t uDay, uint8_t uHours, uint8_t uMinutes, uint8_t uSeconds )
+{
+  static const uint8_t auDaysInMonth[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+  uint32_t uDays = 0;
+  for (uint8_t iYear = 0; iYear < uYear; ++iYear)
+    uDays += (iYear & 0x03) == 0 ? 366 : 365;
+  for (uint8_t iMonth = 1; iMonth < uMonth; ++iMonth)
+    uDays += auDaysInMonth[iMonth - 1] + (iMonth == 2 && (uYear & 0x03) == 0 ? 1 : 0);
+  uDays += uDay - 1;
+
+  return ((uDays * 24UL + uHours) * 60UL + uMinutes) * 60UL + uSeconds;
+}
+
+static void PrintMismatch( Print &rOut, const TimeData &Time, uint32_t uExpected, uint32_t uActual )
+{
+  PrintDateTime(Time, rOut);
+  rOut.print(F(": expected "));
+  rOut.print(uExpected);
+  rOut.print(F(", got "));
+  rOut.println(uActual);
+}
+
+bool CheckTimeDataConversions( Print &rOut )
+{
+  uint32_t uChecked = 0;
+  for (uint8_t iDate = 0; iDate < sizeof(c_auCheckDates) / sizeof(c_auCheckDates[0]); ++iDate)
+  {
+    TimeData Time;
+    Time.years = pgm_read_byte(&c_auCheckDates[iDate][0]);
+    Time.months = pgm_read_byte(&c_auCheckDates[iDate][1]);
+    Time.days = pgm_read_byte(&c_auCheckDates[iDate][2]);
+    Time.weekdays = 0;
+
+    for (uint8_t uHours = 0; uHours < 24; ++uHours)
+    {
+      for (uint8_t uMinutes = 0; uMinutes < 60; ++uMinutes)
+      {
+        for (uint8_t iSecond = 0; iSecond < sizeof(c_auCheckSeconds); ++iSecond)
+        {
+          Time.hours = Decimal2BCD(uHours);
+          Time.minutes = Decimal2BCD(uMinutes);
+          Time.seconds = Decimal2BCD(c_auCheckSeconds[iSecond]);
+
+          uint32_t uExpected = ReferenceTimeStamp(BCD2Decimal(Time.years), BCD2Decimal(Time.months), BCD2Decimal(Time.days),
+            uHours, uMinutes, c_auCheckSeconds[iSecond]);
+          RTCTimeStamp uActual = Time.ToTimeStamp();
+          if (uActual != uExpected)
+          {
+            PrintMismatch(rOut, Time, uExpected, uActual);
+            return false;
+          }
+
+          // And back again.
+          TimeData RoundTrip;
+          RoundTrip.InitalizeFrom(uExpected);
+          if (RoundTrip.Compare(Time) != 0)
+          {
+            PrintMismatch(rOut, RoundTrip, uExpected, RoundTrip.ToTimeStamp());
+            return false;
+          }
+          ++uChecked;
+        }
+      }
+    }
+  }
+
+  rOut.print(uChecked);
+  rOut.println(F(" time stamps checked"));
+  return true;
+}
+
+// The conversions as they were before the division-free versions, for 
+// comparison. They count months as 32 days and years as 13 months, so 
+// their time stamps aren't seconds since 2000; only the timing matters. 
+static void BaselineInitalizeFrom( TimeData &rTime, RTCTimeStamp uTimestamp )
+{
+  uint8_t *pConvert = (uint8_t *)&rTime;
+  pConvert[6] = uTimestamp / (13UL * 32UL * 24UL * 60UL * 60UL);
+  uTimestamp -= pConvert[6] * (13UL * 32UL * 24UL * 60UL * 60UL);
+  pConvert[5] = uTimestamp / (32UL * 24UL * 60UL * 60UL);
+  uTimestamp -= pConvert[5] * (32UL * 24UL * 60UL * 60UL);
+  pConvert[3] = uTimestamp / (24UL * 60UL * 60UL);
+  uTimestamp -= pConvert[3] * (24UL * 60UL * 60UL);
+  pConvert[2] = uTimestamp / (60UL * 60UL);
+  uTimestamp -= pConvert[2] * (60UL * 60UL);
+  pConvert[1] = uTimestamp / (60UL);
+  uTimestamp -= pConvert[1] * (60UL);
+  pConvert[0] = uTimestamp;
+  pConvert[4] = 0;
+
+  for (uint8_t iConvert = 0; iConvert < 7; ++iConvert)
+    pConvert[iConvert] = Decimal2BCD(pConvert[iConvert]);
+}
+
+static RTCTimeStamp BaselineToTimeStamp( const TimeData &rTime )
+{
+  const uint32_t aScale[] = { 1, 60, 60 * 60, 24UL * 60UL * 60UL, 0, 32UL * 24UL * 60UL * 60UL, 13UL * 32UL * 24UL * 60UL * 60UL };
+  const uint8_t *pData = (const uint8_t *)&rTime;
+  uint32_t uResult = 0;
+  for (uint8_t iElement = 0; iElement < 7; ++iElement)
+    uResult += BCD2Decimal(pData[iElement]) * aScale[iElement];
+  return uResult;
+}
+
+#define TIMEDATA_NO_BASELINE 0xffffffffUL
+
+static void PrintTiming( Print &rOut, const __FlashStringHelper *pName, uint32_t uBaseline, uint32_t uElapsed, uint16_t uIterations )
+{
+  rOut.print(pName);
+  rOut.print(F(", "));
+  if (uBaseline == TIMEDATA_NO_BASELINE)
+    rOut.print(F("-"));
+  else
+    rOut.print(uIterations != 0 ? (double)uBaseline / uIterations : 0.0, 2);
+  rOut.print(F(", "));
+  rOut.println(uIterations != 0 ? (double)uElapsed / uIterations : 0.0, 2);
+}
+
+void RunTimeDataBenchmark( Print &rOut, uint16_t uIterations /*= 1000*/ )
+{
+  TimeData Time;
+  Time.InitalizeFrom(0x2a000000UL); // Some time in 2022.
+  RTCTimeStamp volatile uSink = 0;
+
+  rOut.println(F("Operation, baseline us/call, us/call"));
+
+  uint32_t uStart = micros();
+  for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    uSink = BaselineToTimeStamp(Time);
+  uint32_t uBaseline = micros() - uStart;
+  uStart = micros();
+  for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    uSink = Time.ToTimeStamp();
+  PrintTiming(rOut, F("ToTimeStamp"), uBaseline, micros() - uStart, uIterations);
+
+  TimeData Baseline;
+  uStart = micros();
+  for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    BaselineInitalizeFrom(Baseline, 0x2a000000UL + iIteration);
+  uBaseline = micros() - uStart;
+  uStart = micros();
+  for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    Time.InitalizeFrom(0x2a000000UL + iIteration);
+  PrintTiming(rOut, F("InitalizeFrom"), uBaseline, micros() - uStart, uIterations);
+
+  // These are new, so have nothing to compare with. 
+  uStart = micros();
+  for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    Time.AddSeconds(1);
+  PrintTiming(rOut, F("AddSeconds(1)"), TIMEDATA_NO_BASELINE, micros() - uStart, uIterations);
+
+  uStart = micros();
+  for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    Time.AddSeconds(86400UL);
+  PrintTiming(rOut, F("AddSeconds(1 day)"), TIMEDATA_NO_BASELINE, micros() - uStart, uIterations);
+
+  uStart = micros();
+  for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    Time.IncrementSecond();
+  PrintTiming(rOut, F("IncrementSecond"), TIMEDATA_NO_BASELINE, micros() - uStart, uIterations);
+
+  (void)uSink;
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include "WakeScheduler.h"
+
+// Deadlines up to this far away use the countdown timer (1 Hz source).
+// Beyond that, the alarm wakes us at the start of the minute the task is
+// due in and the countdown timer takes it from there.
+#define SCHEDULER_MAX_TIMER_SECONDS 255
+
+ScheduledTask::ScheduledTask( TaskFunction pfnTask, uint32_t uPeriodSeconds, void *pContext /*= NULL*/ )
+  : m_pfnTask(pfnTask)
+  , m_pContext(pContext)
+  , m_uPeriod(uPeriodSeconds)
+{
+  m_uNextDue = 0;
+  m_pNext = NULL;
+}
+
+WakeScheduler::WakeScheduler( RealTimeClock &rClock )
+  : m_rClock(rClock)
+{
+  m_pFirst = NULL;
+}
+
+void WakeScheduler::Add( ScheduledTask &rTask )
+{
+  Unlink(&rTask);
+  rTask.m_uNextDue = m_rClock.GetTimeStamp() + rTask.m_uPeriod;
+  Insert(&rTask);
+}
+
+void WakeScheduler::Remove( ScheduledTask &rTask )
+{
+  Unlink(&rTask);
+}
+
+uint32_t WakeScheduler::Service()
+{
+  // Clear the chip's flags; the alarm holds the interrupt line until then.
+  m_rClock.Service();
+  m_rClock.CheckAlarm();
+
+  RTCTimeStamp uNow = m_rClock.GetTimeStamp();
+
+  while (m_pFirst != NULL && (int32_t)(m_pFirst->m_uNextDue - uNow) <= 0)
+  {
+    ScheduledTask *pTask = m_pFirst;
+    m_pFirst = pTask->m_pNext;
+
+    // Keep to the original schedule, unless we've fallen more than a
+    // period behind. Then skip the missed runs.
+    pTask->m_uNextDue += pTask->m_uPeriod;
+    if ((int32_t)(pTask->m_uNextDue - uNow) <= 0)
+      pTask->m_uNextDue = uNow + pTask->m_uPeriod;
+    Insert(pTask);
+
+    pTask->m_pfnTask(pTask->m_pContext);
+  }
+
+  return ProgramWakeUp(uNow);
+}
+
+uint32_t WakeScheduler::ProgramWakeUp( RTCTimeStamp uNow )
+{
+  if (m_pFirst == NULL)
+  {
+    m_rClock.ClearAlarm();
+    m_rClock.StopTimer();
+    return NO_TASKS;
+  }
+
+  uint32_t uDelay = m_pFirst->m_uNextDue - uNow;
+  if (uDelay <= SCHEDULER_MAX_TIMER_SECONDS)
+  {
+    m_rClock.ClearAlarm();
+    m_rClock.SetTimerPeriodMillis(uDelay * 1000);
+  }
+  else
+  {
+    // The alarm matches minutes, so set it for the start of the minute the
+    // task is due in. That is at least 196 seconds away, so it is in the future.
+    TimeData Alarm;
+    Alarm.InitalizeFrom(m_pFirst->m_uNextDue);
+    m_rClock.StopTimer();
+    m_rClock.SetAlarm(Alarm);
+  }
+
+  return uDelay;
+}
+
+void WakeScheduler::Insert( ScheduledTask *pTask )
+{
+  // Keep the list in due order. Tasks due at the same time run in the
+  // order they were inserted.
+  ScheduledTask **ppLink = &m_pFirst;
+  while (*ppLink != NULL && (int32_t)((*ppLink)->m_uNextDue - pTask->m_uNextDue) <= 0)
+    ppLink = &(*ppLink)->m_pNext;
+
+  pTask->m_pNext = *ppLink;
+  *ppLink = pTask;
+}
+
+void WakeScheduler::Unlink( ScheduledTask *pTask )
+{
+  ScheduledTask **ppLink = &m_pFirst;
+  while (*ppLink != NULL)
+  {
+    if (*ppLink == pTask)
+    {
+      *ppLink = pTask->m_pNext;
+      pTask->m_pNext = NULL;
+      return;
+    }
+    ppLink = &(*ppLink)->m_pNext;
+  }
+}
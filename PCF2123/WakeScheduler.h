@@ -0,0 +1,57 @@
+/* *****************************************************************************
+*  Runs periodic tasks (sample every 10 s, log every minute, upload hourly...)
+*  from the real time clock. The clock's alarm and countdown timer are set for
+*  the nearest deadline only, so the processor can sleep until a task is due.
+*  The scheduler takes over the clock's countdown timer and alarm.
+*  ***************************************************************************** */
+#pragma once
+#include "Arduino.h"
+#include "RealTimeClock.h"
+
+class ScheduledTask
+{
+public:
+  typedef void (*TaskFunction)(void *pContext);
+
+  ScheduledTask(TaskFunction pfnTask, uint32_t uPeriodSeconds, void *pContext = NULL);
+
+  uint32_t GetPeriod() const { return m_uPeriod; }
+  RTCTimeStamp GetNextDue() const { return m_uNextDue; }
+
+private:
+  friend class WakeScheduler;
+
+  TaskFunction m_pfnTask;
+  void *m_pContext;
+  uint32_t m_uPeriod; // Seconds between runs.
+  RTCTimeStamp m_uNextDue;
+  ScheduledTask *m_pNext; // Next task due, when scheduled.
+};
+
+class WakeScheduler
+{
+public:
+  WakeScheduler(RealTimeClock &rClock);
+
+  // Adds a task. It first runs one period from now. Tasks are not copied,
+  // so they must stay in scope while scheduled.
+  void Add(ScheduledTask &rTask);
+  void Remove(ScheduledTask &rTask);
+
+  // Runs any tasks that are due, then sets the clock to wake for the next
+  // one. Call after each wake-up. Returns the seconds until the next task is
+  // due, or NO_TASKS if nothing is scheduled.
+  uint32_t Service();
+
+  enum EConstants { NO_TASKS = 0xffffffffUL };
+
+private:
+  void Insert(ScheduledTask *pTask);
+  void Unlink(ScheduledTask *pTask);
+  uint32_t ProgramWakeUp(RTCTimeStamp uNow);
+
+  RealTimeClock &m_rClock;
+
+  // Scheduled tasks, in the order they are due.
+  ScheduledTask *m_pFirst;
+};
@@ -1,5 +1,4 @@
 #include "SPI EEPROM.h"
-#include "SPI/SPI.h"
 #include "avr/crc16.h"
 #include "avr/wdt.h"
 
@@ -21,7 +20,9 @@ SPI_EEPROM::SPI_EEPROM(uint8_t uChipSelect /*= SS*/, uint8_t uWriteProtectPin, u
   : c_uChipSelectPin(uChipSelect)
   , c_uHoldPin(uHoldPin)
   , c_uWriteProtectPin(uWriteProtectPin)
+  , m_SPI(uChipSelect, SPI_CLOCK_DIV2)
 {
+  m_bPinsConfigured = false;
 }
 
 
@@ -91,28 +92,33 @@ bool SPI_EEPROM::Write( uint32_t uAddress, const uint8_t *pData, uint32_t uDataS
   const uint32_t uPageMask = 0xffff00;
   const uint32_t uAddressMask = 0xffffff; // Forces valid address. 
 
+  // Each page goes through the transfer queue as a write enable, then the
+  // program instruction, address and data; the queue deselects the chip
+  // after each, which starts the write. The bus is held for up to a page 
+  // rather than SHARED_SPI_MAX_LOCKED_BYTES. pData stays in scope because 
+  // we wait for the queue before moving on. 
+  SharedSPI::CSPITransfer WriteEnable, Program;
+  WriteEnable.SetHeader(OP_WRITE_ENABLE);
+
   uint32_t uByteAddress = uAddress & uAddressMask;  // device is 24 bit address. 
   while(uDataSize)
   {
-    uint16_t uPage = uByteAddress & uPageMask;
-    uint8_t uSREGEntry = SREG;
-    cli();
-
-    Select(true);
-    SPI.transfer(OP_WRITE_ENABLE);  // Enable writing. 
-    Select(false);
-
-    Select(true);
-    SPI.transfer(uInstruction);         // Initiate write to memory operation.
-    SendAddress(uAddress);
-    while (uPage == (uByteAddress & uPageMask) && uDataSize)
-    {
-      SPI.transfer(*pData++);
-      ++uByteAddress;
-      --uDataSize;
-    }
-    Select(false); // Also initiates write operation. 
-    SREG = uSREGEntry;
+    uint32_t uPageEnd = (uByteAddress & uPageMask) + 0x100;
+    uint16_t uLength = uDataSize < uPageEnd - uByteAddress ? uDataSize : uPageEnd - uByteAddress;
+
+    Program.SetHeader(uInstruction);
+    Program.AddHeader((uByteAddress >> 16) & 0xff);
+    Program.AddHeader((uByteAddress >> 8) & 0xff);
+    Program.AddHeader((uByteAddress) & 0xff);
+    Program.SetData(pData, NULL, uLength);
+
+    m_SPI.Queue(WriteEnable);
+    m_SPI.Queue(Program);
+    SharedSPI::CSPITransferQueue::WaitForIdle();
+
+    pData += uLength;
+    uByteAddress += uLength;
+    uDataSize -= uLength;
     if (!WaitForWriteCompletion())
     { 
       Serial.println(F("EEPROM write error"));
@@ -132,17 +138,21 @@ void SPI_EEPROM::Read( uint32_t uAddress, uint8_t *pData, uint32_t uDataSize, ui
 {
   Initialize();
 
-  uint8_t uSREGEntry = SREG;
-  cli();
-  Select(true);
-  SPI.transfer(uInstruction);
-  SendAddress(uAddress);
-  while (uDataSize--)
+  // Read in chunks, letting go of the bus in between so interrupt handlers
+  // waiting for it aren't held up by a long read. 
+  while (uDataSize)
   {
-    *pData++ = SPI.transfer(0); // Read data. 
+    uint16_t uChunk = uDataSize > SHARED_SPI_MAX_LOCKED_BYTES ? SHARED_SPI_MAX_LOCKED_BYTES : uDataSize;
+    m_SPI.BeginTransaction();
+    m_SPI.Transfer(uInstruction);
+    SendAddress(uAddress);
+    m_SPI.Receive(pData, uChunk);
+    m_SPI.EndTransaction();
+
+    uAddress += uChunk;
+    pData += uChunk;
+    uDataSize -= uChunk;
   }
-  Select(false);
-  SREG = uSREGEntry;
 }
 
 
@@ -151,29 +161,31 @@ uint16_t SPI_EEPROM::CalculateChecksum( uint32_t uStartAddress, uint32_t uLength
   Initialize();
   wdt_reset();
   uint16_t uChecksum = 0; 
-  uint8_t uSREGEntry = SREG;
-  cli();
-  Select(true);
-  SPI.transfer(OP_READ);
-  SendAddress(uStartAddress);
-  while (uLength--)
+  while (uLength)
   {
-    uint8_t uValue = SPI.transfer(0); // Read data. 
-    uChecksum = _crc16_update(uChecksum, uValue);
+    uint16_t uChunk = uLength > SHARED_SPI_MAX_LOCKED_BYTES ? SHARED_SPI_MAX_LOCKED_BYTES : uLength;
+    m_SPI.BeginTransaction();
+    m_SPI.Transfer(OP_READ);
+    SendAddress(uStartAddress);
+    for (uint16_t iByte = 0; iByte < uChunk; ++iByte)
+    {
+      uint8_t uValue = m_SPI.Transfer(0); // Read data. 
+      uChecksum = _crc16_update(uChecksum, uValue);
+    }
+    m_SPI.EndTransaction();
+
+    uStartAddress += uChunk;
+    uLength -= uChunk;
   }
-  Select(false);
-  SREG = uSREGEntry;
   return uChecksum;
 }
 
 void SPI_EEPROM::Initialize()
 {
-  SPI.begin();
-  SPI.setBitOrder(MSBFIRST);
-  SPI.setClockDivider(SPI_CLOCK_DIV2);
-  SPI.setDataMode(SPI_MODE0);
-  pinMode(c_uChipSelectPin, OUTPUT);
-  Select(false);
+  if (m_bPinsConfigured)
+    return;
+
+  m_SPI.Begin();
 
   // hold and write protect function not currently used,
   // but we have to disable write protect and turn off hold. 
@@ -182,43 +194,38 @@ void SPI_EEPROM::Initialize()
   pinMode(c_uWriteProtectPin, OUTPUT);
   digitalWrite(c_uHoldPin, HIGH);
   digitalWrite(c_uWriteProtectPin, HIGH);
-}
-
-void SPI_EEPROM::Select( bool bSelect )
-{
-  digitalWrite(c_uChipSelectPin, bSelect ? LOW : HIGH);
+  m_bPinsConfigured = true;
 }
 
 bool SPI_EEPROM::WaitForWriteCompletion()
 {
-  uint8_t uStatus;
-  uint32_t uStartTime = millis();
+  uint8_t uStatus = 0;
   uint32_t uIterations = 0; 
-  uint8_t uSREGEntry = SREG;
 
+  SharedSPI::CSPITransfer ReadStatus;
+  ReadStatus.SetHeader(OP_READ_STATUS_REG);
+  ReadStatus.SetData(NULL, &uStatus, 1);
 
-  cli();
-  Select(true);
-  SPI.transfer(OP_READ_STATUS_REG);
   do 
   {
-    uStatus = SPI.transfer(0);
+    // Each poll is its own transfer so other devices can use the bus while
+    // the page is written. 
+    m_SPI.Queue(ReadStatus);
+    SharedSPI::CSPITransferQueue::WaitForIdle();
 
     // using loop counter to 'time-out' because millis time won't 
-    // function properly in here (interrupts are turned off). 
+    // function if the caller has turned interrupts off. 
     ++uIterations;
 
   } while ((uStatus & 0x01) && uIterations < MAX_COMPLETION_ITERATIONS);
-  Select(false);
-  SREG = uSREGEntry;
 
   return uIterations < MAX_COMPLETION_ITERATIONS;
 }
 
 void SPI_EEPROM::SendAddress( uint32_t uAddress )
 {
-  SPI.transfer((uAddress >> 16) & 0xff);
-  SPI.transfer((uAddress >> 8) & 0xff);
-  SPI.transfer((uAddress) & 0xff);
+  m_SPI.Transfer((uAddress >> 16) & 0xff);
+  m_SPI.Transfer((uAddress >> 8) & 0xff);
+  m_SPI.Transfer((uAddress) & 0xff);
 }
 
@@ -7,6 +7,7 @@
 *  ***************************************************************************** */
 #pragma once
 #include <Arduino.h>
+#include "../SharedSPI/SharedSPI.h"
 
 class SPI_EEPROM
 {
@@ -14,6 +15,8 @@ private:
   const uint8_t c_uChipSelectPin;
   const uint8_t c_uWriteProtectPin;
   const uint8_t c_uHoldPin;
+  const SharedSPI::CSharedSPI m_SPI;
+  bool m_bPinsConfigured;
 
 
 public:
@@ -33,8 +36,8 @@ public:
   void Read(uint32_t uAddress, uint8_t *pData, uint32_t uDataSize);
   uint16_t CalculateChecksum(uint32_t uStartAddress, uint32_t uLength);
 private:
+  // Sets up the pins, the first time only. 
   void Initialize();
-  void Select(bool bSelect);
   bool WaitForWriteCompletion();
   bool Write(uint32_t uAddress, const uint8_t *pData, uint32_t uDataSize, uint8_t uInstruction);
   void Read(uint32_t uAddress, uint8_t *pData, uint32_t uDataSize, uint8_t uInstruction);
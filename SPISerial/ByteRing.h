@@ -0,0 +1,127 @@
+/* *****************************************************************************
+*  A circular buffer of bytes in storage supplied by the owner, so its size 
+*  can be chosen at run time. Unlike CircularBuffer, adding to a full ring
+*  fails rather than overwriting the oldest data. 
+*  Not interrupt safe: the owner disables interrupts around access if the 
+*  ring is shared with an interrupt handler. Unlike the lock free 
+*  CircularBuffer it can't do without: its 16 bit indices take two reads on
+*  the AVR, and framing takes bytes back from the head (RemoveNewest). 
+*  ***************************************************************************** */
+
+#pragma once
+#include <stdint.h>
+#include <string.h>
+
+namespace NSPISerial
+{
+  class ByteRing
+  {
+    uint8_t *m_puStorage;
+    uint16_t m_uCapacity;
+
+    // Index where the next byte is added. 
+    uint16_t m_uHead;
+
+    // Index of the oldest byte. 
+    uint16_t m_uTail;
+
+    uint16_t m_uCount;
+
+  public:
+    ByteRing(uint8_t *puStorage, uint16_t uCapacity)
+      : m_puStorage(puStorage)
+      , m_uCapacity(uCapacity)
+    {
+      Clear();
+    }
+
+    bool Add(uint8_t uData)
+      /* Adds a byte. Returns false, and drops the byte, if the ring is full. */
+    {
+      if (m_uCount == m_uCapacity)
+        return false;
+
+      m_puStorage[m_uHead] = uData;
+      if (++m_uHead == m_uCapacity)
+        m_uHead = 0;
+      ++m_uCount;
+      return true;
+    }
+
+    uint8_t Peek() const
+      /* The oldest byte. Only valid if the ring is not empty. */
+    {
+      return m_puStorage[m_uTail];
+    }
+
+    uint8_t Remove()
+      /* Removes and returns the oldest byte. Only valid if the ring is 
+      not empty. */
+    {
+      uint8_t uData = m_puStorage[m_uTail];
+      if (++m_uTail == m_uCapacity)
+        m_uTail = 0;
+      --m_uCount;
+      return uData;
+    }
+
+    uint16_t Remove(uint8_t *puData, uint16_t uLength)
+      /* Copies out up to uLength of the oldest bytes, removing them. 
+      Returns the number copied. */
+    {
+      if (uLength > m_uCount)
+        uLength = m_uCount;
+
+      const uint8_t *puFirst, *puSecond;
+      uint16_t uFirst, uSecond;
+      GetSpan(uLength, puFirst, uFirst, puSecond, uSecond);
+      memcpy(puData, puFirst, uFirst);
+      memcpy(puData + uFirst, puSecond, uSecond);
+      Skip(uLength);
+      return uLength;
+    }
+
+    void GetSpan(uint16_t uLength, const uint8_t *&rpuFirst, uint16_t &ruFirst, 
+      const uint8_t *&rpuSecond, uint16_t &ruSecond) const
+      /* The oldest uLength bytes, in place. At most two pieces: up to the end
+      of the storage, then from the start. uLength must not exceed Count. */
+    {
+      ruFirst = m_uCapacity - m_uTail;
+      if (ruFirst > uLength)
+        ruFirst = uLength;
+      rpuFirst = m_puStorage + m_uTail;
+      rpuSecond = m_puStorage;
+      ruSecond = uLength - ruFirst;
+    }
+
+    void Skip(uint16_t uLength)
+      /* Removes the oldest uLength bytes without copying them. uLength must
+      not exceed Count. */
+    {
+      m_uTail += uLength;
+      if (m_uTail >= m_uCapacity)
+        m_uTail -= m_uCapacity;
+      m_uCount -= uLength;
+    }
+
+    void RemoveNewest(uint16_t uLength)
+      /* Takes back the uLength bytes added most recently. uLength must not 
+      exceed Count. */
+    {
+      m_uHead = m_uHead >= uLength ? m_uHead - uLength : m_uHead + m_uCapacity - uLength;
+      m_uCount -= uLength;
+    }
+
+    void Clear()
+    {
+      m_uHead = 0;
+      m_uTail = 0;
+      m_uCount = 0;
+    }
+
+    bool IsEmpty() const { return m_uCount == 0; }
+    bool IsFull() const { return m_uCount == m_uCapacity; }
+    uint16_t Count() const { return m_uCount; }
+    uint16_t Capacity() const { return m_uCapacity; }
+  };
+}
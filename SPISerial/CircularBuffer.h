@@ -1,13 +1,29 @@
 /* *****************************************************************************
 *  A templated circular buffer. 
+*
+*  Asking for LOCK_FREE gives a queue for one producer and one consumer 
+*  (say, the main loop and an interrupt handler) that needs no interrupts 
+*  off. Its capacity must be a power of two, up to 128, so it can mask 
+*  single byte indices instead of dividing. Unlike the general buffer it 
+*  doesn't overwrite: Add fails when the buffer is full. Only the producer
+*  may Add; only the consumer may PopTail, DropRecords or Clear.
 *  ***************************************************************************** */
 
 #pragma once
 #include <stdint.h>
+#include <string.h>
+
+// Stops the compiler moving memory accesses across it. The AVR doesn't 
+// reorder them itself. 
+#define CIRCULAR_BUFFER_BARRIER() __asm__ __volatile__ ("" ::: "memory")
 
 namespace NSPISerial
 {
-  template <class T, uint16_t MAX_ENTRIES> class CircularBuffer
+  // LOCK_FREE picks the implementation, and with it what Add does: when
+  // false Add returns void and overwrites the oldest value if the buffer is
+  // full; when true it returns bool and fails instead. 
+  template <class T, uint16_t MAX_ENTRIES, bool LOCK_FREE = false> 
+  class CircularBuffer
   {
     T m_aBuffer[MAX_ENTRIES];
 
@@ -266,4 +282,244 @@ namespace NSPISerial
     };
   };
 
+  template <class T, uint16_t MAX_ENTRIES> class CircularBuffer<T, MAX_ENTRIES, true>
+  {
+    enum EConstants { INDEX_MASK = MAX_ENTRIES - 1 };
+
+    // Fails to compile unless the capacity is a power of two up to 128. 
+    typedef char CheckCapacity[(MAX_ENTRIES & (MAX_ENTRIES - 1)) == 0 && MAX_ENTRIES <= 128 ? 1 : -1];
+
+    T m_aBuffer[MAX_ENTRIES];
+
+    // Free running counts of values added and removed. Only the producer 
+    // writes the head and only the consumer the tail. Their difference is 
+    // the number stored. 
+    volatile uint8_t m_uHead;
+    volatile uint8_t m_uTail;
+
+  public:
+    CircularBuffer()
+      /* Initializes an empty buffer.  */
+    {
+      m_uHead = 0;
+      m_uTail = 0;
+    }
+
+    uint8_t ElementSize()
+    {
+      return sizeof(T);
+    }
+
+    bool IsEmpty()
+      /* Returns true if no data has been stored in the buffer, 
+      and false if at least one value has been stored. */
+    {
+      return m_uHead == m_uTail;
+    }
+
+    bool IsFull()
+    {
+      return (uint8_t)(m_uHead - m_uTail) == MAX_ENTRIES;
+    }
+
+    bool Add(const T Data)
+      /* Adds a new value to the end of the buffer. Returns false, and 
+      drops the value, if the buffer is full. */
+    {
+      uint8_t uHead = m_uHead;
+      if ((uint8_t)(uHead - m_uTail) == MAX_ENTRIES)
+        return false;
+
+      // The value must be in place before the consumer can see it. 
+      m_aBuffer[uHead & INDEX_MASK] = Data;
+      CIRCULAR_BUFFER_BARRIER();
+      m_uHead = uHead + 1;
+      return true;
+    }
+
+    bool Add(const T *pData)
+      /* Adds a new value to the end of the buffer. Returns false, and 
+      drops the value, if the buffer is full. */
+    {
+      uint8_t uHead = m_uHead;
+      if ((uint8_t)(uHead - m_uTail) == MAX_ENTRIES)
+        return false;
+
+      memcpy(&m_aBuffer[uHead & INDEX_MASK], pData, sizeof(T));
+      CIRCULAR_BUFFER_BARRIER();
+      m_uHead = uHead + 1;
+      return true;
+    }
+
+    T *Head()
+      /* A pointer to the last value stored in the buffer. 
+      Only valid if the buffer is not empty. */
+    {
+      return m_aBuffer + ((m_uHead - 1) & INDEX_MASK);
+    }
+
+    T *Tail()
+      /* A pointer to the first value stored in the buffer. Only 
+      valid if the buffer is not empty. */
+    {
+      return m_aBuffer + (m_uTail & INDEX_MASK);
+    }
+
+    void PopTail()
+    {
+      // Finish with the value before handing its slot back. 
+      CIRCULAR_BUFFER_BARRIER();
+      uint8_t uTail = m_uTail;
+      if (uTail != m_uHead)
+        m_uTail = uTail + 1;
+    }
+
+    void DropRecords(int nRecordsToDrop)
+    {
+      while (nRecordsToDrop--)
+        PopTail();
+    }
+
+    void Clear()
+      /* Empties the circular buffer, from the consumer's side. */
+    {
+      m_uTail = m_uHead;
+    }
+
+    int CountStored() const
+      /* Returns the number of entries that are stored
+      in the circular buffer. */
+    {
+      return (uint8_t)(m_uHead - m_uTail);
+    }
+
+    int MaxSize() const
+      /* Returns the maximum number of values that can
+      be stored in the circular buffer. */
+    {
+      return MAX_ENTRIES;
+    }
+
+    uint16_t GetTailIndex() const
+    {
+      return m_uTail & INDEX_MASK;
+    }
+
+    void Dump(Print &rDestination)
+      /* Writes the current content of the serial buffer to a
+      serial stream. The values from the buffer are written 
+      in the order stored. */
+    {
+      for (int i = 0; i < MAX_ENTRIES; ++i)
+      {
+        rDestination.print(i);
+        rDestination.print(": ");
+        rDestination.println(m_aBuffer[i]);
+      }
+
+      rDestination.print(F("Head: "));
+      rDestination.print(m_uHead & INDEX_MASK);
+      rDestination.print(F(", "));
+      rDestination.println(CountStored());
+    }
+
+    class CForwardIterator
+      /* Class to iterate through the circular buffer starting at the tail
+      and ending at the head. Only the consumer may iterate. */
+    {
+      // The buffer we iterate through. 
+      const CircularBuffer *m_pBuffer;
+
+      // Free running position of the current value. 
+      uint8_t m_uCurrent;
+
+      // Free running position just past the newest value when created.
+      uint8_t m_uEnd;
+
+    public:
+      CForwardIterator(const CircularBuffer *pBuffer) : m_pBuffer(pBuffer)
+      {
+        m_uCurrent = pBuffer->m_uTail;
+        m_uEnd = pBuffer->m_uHead;
+      }
+
+      const T *CurrentValue()
+        /* Returns pointer to the current value. */
+      {
+        return m_pBuffer->m_aBuffer + (m_uCurrent & INDEX_MASK);
+      }
+
+      int CurrentIndex()
+        /* Returns the current index of the iterator in the buffer. */
+      {
+        return m_uCurrent & INDEX_MASK;
+      }
+
+      void Next()
+        /* Moves the iterator to the next position in the buffer, unless
+        all the values have been read out. */
+      {
+        if (!AtEnd())
+          ++m_uCurrent;
+      }
+
+      bool AtEnd()
+        /* Returns true if all the entries that were in the buffer when the
+        iterator was created have been stepped through. */
+      {
+        return m_uCurrent == m_uEnd;
+      }
+    };
+
+    class CReverseIterator
+      /* Class to iterate through the circular buffer starting at the head
+      and ending at the tail. Only the consumer may iterate. */
+    {
+      // The buffer that we iterate through. 
+      const CircularBuffer *m_pBuffer;
+
+      // Free running position just past the current value. 
+      uint8_t m_uCurrent;
+
+      // Free running position of the oldest value when created. 
+      uint8_t m_uEnd;
+
+    public:
+      CReverseIterator(CircularBuffer *pBuffer) : m_pBuffer(pBuffer)
+        /* Initializes the iterator to begin at the current head
+        position in buffer. */
+      {
+        m_uCurrent = pBuffer->m_uHead;
+        m_uEnd = pBuffer->m_uTail;
+      }
+
+      const T *CurrentValue()
+        /* Returns pointer to the current value. */
+      {
+        return m_pBuffer->m_aBuffer + ((uint8_t)(m_uCurrent - 1) & INDEX_MASK);
+      }
+
+      int CurrentIndex()
+        /* Returns the current index of the iterator in the buffer. */
+      {
+        return (uint8_t)(m_uCurrent - 1) & INDEX_MASK;
+      }
+
+      void Previous()
+        /* Moves the iterator to the previous position in the buffer, 
+        unless all the values have been read out. */
+      {
+        if (!AtEnd())
+          --m_uCurrent;
+      }
+
+      bool AtEnd()
+        /* Returns true if all the entries that were in the buffer when the
+        iterator was created have been stepped through. */
+      {
+        return m_uCurrent == m_uEnd;
+      }
+    };
+  };
+
 }
\ No newline at end of file
@@ -0,0 +1,149 @@
+/* *****************************************************************************
+*  Loopback and buffer benchmarks for SPISerial. Only built when 
+*  SPISER_MEASURE is defined. The chip's internal loopback carries the data, 
+*  so nothing needs to be wired up.
+*  ***************************************************************************** */
+#include "SPISerial.h"
+
+#ifdef SPISER_MEASURE
+
+// Bytes written at a time while streaming.
+#define BENCHMARK_CHUNK 16
+
+static uint8_t BenchmarkPattern( uint16_t uIndex )
+{
+  // Changes every byte and doesn't repeat every 256.
+  return (uint8_t)(uIndex ^ (uIndex >> 8));
+}
+
+bool SPISerial::RunLoopbackBenchmark( Print &rOut, const unsigned long *puBaudRates, uint8_t uRates, uint16_t uLength /*= 2048*/ )
+{
+  bool bPassed = true;
+
+  rOut.println(F("Baud, bytes/s, rx handling %, SPI bytes/payload byte, first byte us, errors"));
+  for (uint8_t iRate = 0; iRate < uRates; ++iRate)
+  {
+    unsigned long uBaudRate = puBaudRates[iRate];
+    rOut.print(uBaudRate);
+    if (!begin(uBaudRate))
+    {
+      rOut.println(F(", not possible"));
+      bPassed = false;
+      continue;
+    }
+    SetLoopback(true);
+    while (read() >= 0)
+      ;
+
+    // Twice the time the data takes on the wire, at 10 bits a byte.
+    uint32_t uTimeoutMillis = 100 + (uint32_t)uLength * 20000UL / m_uActualBaudRate;
+
+    uint32_t uStartMillis = millis();
+    uint32_t uStart = micros();
+    write(BenchmarkPattern(0));
+    while (available() == 0 && millis() - uStartMillis < uTimeoutMillis)
+      ;
+    uint32_t uFirstByteMicros = micros() - uStart;
+    uint16_t uErrors = read() == BenchmarkPattern(0) ? 0 : 1;
+
+    // Keep no more in flight than the receive buffer can hold, so nothing
+    // is dropped while we are busy writing.
+    ResetStatistics();
+    uint16_t uSent = 0;
+    uint16_t uReceived = 0;
+    uStartMillis = millis();
+    uStart = micros();
+    while (uReceived < uLength && millis() - uStartMillis < uTimeoutMillis)
+    {
+      if (uSent < uLength && uSent - uReceived + BENCHMARK_CHUNK <= m_ReceiveBuffer.Capacity())
+      {
+        uint8_t auChunk[BENCHMARK_CHUNK];
+        uint8_t uChunk = uLength - uSent < BENCHMARK_CHUNK ? uLength - uSent : BENCHMARK_CHUNK;
+        for (uint8_t iByte = 0; iByte < uChunk; ++iByte)
+          auChunk[iByte] = BenchmarkPattern(uSent + iByte);
+        uSent += write(auChunk, uChunk);
+      }
+
+      int nData;
+      while ((nData = read()) >= 0)
+      {
+        if (nData != BenchmarkPattern(uReceived))
+          ++uErrors;
+        ++uReceived;
+      }
+    }
+    uint32_t uElapsed = micros() - uStart;
+    uErrors += uLength - uReceived;
+
+    Statistics Stats;
+    GetStatistics(Stats);
+    SetLoopback(false);
+
+    rOut.print(F(", "));
+    rOut.print(uElapsed != 0 ? (uint32_t)((uint64_t)uReceived * 1000000UL / uElapsed) : 0);
+    rOut.print(F(", "));
+    rOut.print(uElapsed != 0 ? Stats.m_uReceiveMicros * 100.0 / uElapsed : 0.0, 1);
+    rOut.print(F(", "));
+    rOut.print(Stats.m_uPayloadBytes != 0 ? (double)Stats.m_uSPIBytes / Stats.m_uPayloadBytes : 0.0, 2);
+    rOut.print(F(", "));
+    rOut.print(uFirstByteMicros);
+    rOut.print(F(", "));
+    rOut.println(uErrors);
+
+    if (uErrors != 0)
+      bPassed = false;
+  }
+
+  return bPassed;
+}
+
+// Fills the buffer then drains it through Tail and PopTail, as write() and
+// the transmit interrupt do. Returns the microseconds taken. 
+template <class TBuffer> static uint32_t TimeBuffer( TBuffer &rBuffer, uint16_t uRounds, uint16_t &ruErrors )
+{
+  uint8_t volatile uSink = 0;
+  uint32_t uStart = micros();
+  for (uint16_t iRound = 0; iRound < uRounds; ++iRound)
+  {
+    for (int iEntry = 0; iEntry < rBuffer.MaxSize(); ++iEntry)
+      rBuffer.Add((uint8_t)(iRound + iEntry));
+    for (int iEntry = 0; iEntry < rBuffer.MaxSize(); ++iEntry)
+    {
+      uSink = *rBuffer.Tail();
+      if (uSink != (uint8_t)(iRound + iEntry))
+        ++ruErrors;
+      rBuffer.PopTail();
+    }
+  }
+  return micros() - uStart;
+}
+
+static void PrintBufferTiming( Print &rOut, const __FlashStringHelper *pName, uint32_t uElapsed, uint32_t uBytes )
+{
+  rOut.print(pName);
+  rOut.print(F(", "));
+  rOut.println(uBytes != 0 ? uElapsed * 1000.0 / uBytes : 0.0, 0);
+}
+
+void SPISerial::RunBufferBenchmark( Print &rOut, uint16_t uRounds /*= 100*/ )
+{
+  // Same capacity as the transmit buffer; only the implementation differs. 
+  NSPISerial::CircularBuffer<uint8_t, TX_BUFFER_SIZE, false> General;
+  NSPISerial::CircularBuffer<uint8_t, TX_BUFFER_SIZE, true> LockFree;
+  uint16_t uErrors = 0;
+
+  uint32_t uGeneral = TimeBuffer(General, uRounds, uErrors);
+  uint32_t uLockFree = TimeBuffer(LockFree, uRounds, uErrors);
+
+  uint32_t uBytes = (uint32_t)uRounds * TX_BUFFER_SIZE;
+  rOut.println(F("Buffer, ns/byte added and removed"));
+  PrintBufferTiming(rOut, F("General"), uGeneral, uBytes);
+  PrintBufferTiming(rOut, F("Lock free"), uLockFree, uBytes);
+  if (uErrors != 0)
+  {
+    rOut.print(F("Errors: "));
+    rOut.println(uErrors);
+  }
+}
+
+#endif
@@ -10,6 +10,8 @@
 #define REG_SIGNALED_INTERRUPT 0x02 // IIR
 #define REG_RX_LEVEL 0x09 // RXLVL
 #define REG_EXTRA_FEATURES_CONTROL 0x0f // EFCR. 
+#define REG_SCRATCHPAD 0x07 // SPR
+#define REG_LINE_STATUS 0x05 // LSR
 
 // Special register only avalabile when LCR[7] == 1
 #define REGS_DIVIDER_LOW 0x00  
@@ -17,6 +19,19 @@
 
 // Special registers only available when LCR = 0xBF
 #define REGEH_ENHANCED_FEATURES 0x02 // EFR
+#define REGEH_XON1 0x04
+#define REGEH_XON2 0x05
+#define REGEH_XOFF1 0x06
+#define REGEH_XOFF2 0x07
+
+// Special registers only available when MCR[2] = 1 and EFR[4] = 1. They 
+// replace MSR and SPR. 
+#define REGT_TRANSMISSION_CONTROL 0x06 // TCR
+#define REGT_TRIGGER_LEVEL 0x07 // TLR
+
+// Trigger level register data. Levels are in units of 4 bytes; 0 leaves 
+// the trigger to FCR. 
+#define TLR_RX_TRIGGER_SHIFT 4
 
 // Line control register data
 #define LCR_ENHANCED_MODE 0xbf // Required for setting some register values. 
@@ -36,17 +51,26 @@
 #define MCREH_IRDA_MODE 0x40
 #define MCREH_XON 0x20
 #define MCR_LOOPBACK 0x10
-#define MCREH_EN_FIFO_TRIGGER 0x08 // enables tcr, tcl. 
+#define MCREH_EN_FIFO_TRIGGER 0x04 // enables tcr, tlr. 
+
+// Enhanced features register data
+#define EFR_AUTO_CTS 0x80
+#define EFR_AUTO_RTS 0x40
+#define EFR_ENHANCED_FUNCTIONS 0x10
+#define EFR_TX_XON1_XOFF1 0x08
+#define EFR_RX_XON1_XOFF1 0x02
 
 // FIFO control register data
 #define FCR_RX_TRIGGER_8_CHAR 0x00
 #define FCR_RX_TRIGGER_16_CHAR 0x40
 #define FCR_RX_TRIGGER_56_CHAR 0x80
 #define FCR_RX_TRIGGER_60_CHAR 0xC0
-#define FCR_TX_TRIGGER_8_CHAR 0x00
-#define FCR_TX_TRIGGER_16_CHAR 0x10
-#define FCR_TX_TRIGGER_56_CHAR 0x20
-#define FCR_TX_TRIGGER_60_CHAR 0x30
+// The tx trigger is the number of spaces free in the fifo. Requires 
+// enhanced features to be enabled. 
+#define FCR_TX_TRIGGER_8_SPACES 0x00
+#define FCR_TX_TRIGGER_16_SPACES 0x10
+#define FCR_TX_TRIGGER_32_SPACES 0x20
+#define FCR_TX_TRIGGER_56_SPACES 0x30
 #define FCR_RESET_TX_FIFO 0x04
 #define FCR_RESET_RX_FIFO 0x02
 #define FCR_ENABLE_FIFOS 0x01
@@ -62,6 +86,18 @@
 
 // Interrupt signal data
 #define IIR_MASK 0x3f
+#define IIR_NONE_PENDING 0x01
+#define IIR_RX_LINE_STATUS 0x06
 #define IIR_RX_FIFO_THRESHOLD 0x04
+#define IIR_RX_TIMEOUT 0x0C // Data below the trigger has waited 4 characters. 
+
+// Line status data
+#define LSR_OVERRUN_ERROR 0x02
+#define LSR_PARITY_ERROR 0x04
+#define LSR_FRAMING_ERROR 0x08
+#define LSR_BREAK 0x10
+#define LSR_TX_EMPTY 0x40 // Transmit fifo and shift register are empty. 
 
 #define EFCR_TXDISABLE 0x04
+#define EFCR_RTS_CONTROL 0x10 // RS-485: RTS drives the transmitter enable. 
+#define EFCR_RTS_INVERT 0x20 // RS-485: RTS high while transmitting. 
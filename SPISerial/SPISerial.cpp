@@ -1,59 +1,191 @@
 #include "SPISerial.h"
-#include "Spi/SPI.h"
 #include "Registers.h"
+#include "../WarmStart/WarmStart.h"
 
 // data flags to indicate read/ write operations. 
+#define SPISER_RW_MASK 0x80
 #define SPISER_WRITE 0x00
 #define SPISER_READ 0x80
 
-#define SPISER_XTAL_FREQ 14745600 // Hz
+#define SPISER_XTAL_FREQ 14745600 // Hz, default. 
 
-// For interrupt handler. 
-SPISerial * SPISerial::s_pThis = NULL;
+// Largest baud rate error we accept, in parts per thousand. Both ends of 
+// the link together must stay within about 3%. 
+#define SPISER_BAUD_TOLERANCE_PERMILLE 15
 
+#ifdef SPISER_MEASURE
+#define SPISER_COUNT(Field, Amount) \
+  do { uint8_t uSREGCount = SREG; cli(); m_Statistics.Field += (Amount); SREG = uSREGCount; } while (0)
+#else
+#define SPISER_COUNT(Field, Amount)
+#endif
+
+// SLIP (RFC 1055) special bytes. 
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+// Started channels, for the interrupt handler. 
+SPISerial * SPISerial::s_pFirst = NULL;
+
+// UART settings kept across resets, for up to this many channels. If the 
+// chip still has them, begin() doesn't need to reset and reconfigure it. 
+#define SPISER_MAX_WARM_CHANNELS 4
+#define SPISER_UNUSED_PIN 0xff
+
+struct SPISerialWarmChannel
+{
+  uint8_t m_uChipSelectPin;
+  uint8_t m_uChannel;
+  uint16_t m_uDivisor;
+  uint8_t m_uModemControl;
+};
+
+struct SPISerialWarmState
+{
+  SPISerialWarmChannel m_aChannels[SPISER_MAX_WARM_CHANNELS];
+};
+static WarmStart::Snapshot<SPISerialWarmState> s_WarmState WARM_START_NOINIT;
+
+static SPISerialWarmChannel *FindWarmChannel( uint8_t uChipSelectPin, uint8_t uChannel, bool bClaim )
+  /* The saved settings for a channel. If bClaim is true and there are none,
+  a free entry is returned, if any. */
+{
+  if (!s_WarmState.IsValid())
+  {
+    for (uint8_t iChannel = 0; iChannel < SPISER_MAX_WARM_CHANNELS; ++iChannel)
+      s_WarmState.m_Data.m_aChannels[iChannel].m_uChipSelectPin = SPISER_UNUSED_PIN;
+    s_WarmState.Save();
+  }
+
+  SPISerialWarmChannel *pFree = NULL;
+  for (uint8_t iChannel = 0; iChannel < SPISER_MAX_WARM_CHANNELS; ++iChannel)
+  {
+    SPISerialWarmChannel *pWarm = s_WarmState.m_Data.m_aChannels + iChannel;
+    if (pWarm->m_uChipSelectPin == uChipSelectPin && pWarm->m_uChannel == uChannel)
+      return pWarm;
+    if (pFree == NULL && pWarm->m_uChipSelectPin == SPISER_UNUSED_PIN)
+      pFree = pWarm;
+  }
 
-SPISerial::SPISerial( uint8_t uChipSelectPin, uint8_t uInterruptPin )
+  if (bClaim && pFree != NULL)
+  {
+    pFree->m_uChipSelectPin = uChipSelectPin;
+    pFree->m_uChannel = uChannel;
+    return pFree;
+  }
+  return NULL;
+}
+
+
+SPISerial::SPISerial( uint8_t uChipSelectPin, uint8_t uInterruptPin, uint8_t uChannel /*= 0*/, 
+  uint8_t *puReceiveBuffer /*= NULL*/, uint16_t uReceiveBufferSize /*= 0*/ )
   : m_uChipSelectPin(uChipSelectPin)
+  , m_SPI(uChipSelectPin, SPI_CLOCK_DIV8, true, SPISER_RW_MASK, SPISER_READ, SPISER_WRITE)
   , m_uInterruptPin(uInterruptPin)
-  , m_uInterruptChannel(uInterruptPin - 2)
+  , m_uChannel(uChannel)
+#if SPISER_DEFAULT_RX_BUFFER > 0
+  , m_ReceiveBuffer(puReceiveBuffer != NULL ? puReceiveBuffer : m_auDefaultReceiveBuffer,
+    puReceiveBuffer != NULL ? uReceiveBufferSize : (uint16_t)SPISER_DEFAULT_RX_BUFFER)
+#else
+  , m_ReceiveBuffer(puReceiveBuffer, puReceiveBuffer != NULL ? uReceiveBufferSize : 0)
+#endif
 {
   m_uTransmitTimeout = 0; 
   m_LastTxError = TxErr_None;
   m_bTransmitterEnabled = true; 
+  m_uInterruptEnable = IER_RX_FIFO_THRESHOLD | IER_RX_STATUS;
+  m_uFlowControl = Flow_None;
+  m_uTurnaroundMicros = 0;
+  m_uLastReceiveMicros = 0;
+  m_uModemControl = MCREH_DIVIDE_BY_1;
+  m_ReceiveMode = Receive_Bulk;
+  m_uReceiveTrigger = RX_TRIGGER_MAX;
+  m_uTriggerStreak = 0;
+  m_uCrystalFrequency = SPISER_XTAL_FREQ;
+  m_uActualBaudRate = 0;
+  m_pNext = NULL;
+  m_FrameMode = Frame_None;
+  m_uDelimiter = '\n';
+  m_pfnArrivalClock = NULL;
+  m_uReadTime = 0;
+  m_uPartialTime = 0;
+  ClearReceived();
+  ResetErrorCounts();
+#ifdef SPISER_MEASURE
+  ResetStatistics();
+#endif
 }
 
 
 SPISerial::~SPISerial(void)
 {
+  uint8_t uSREGEntry = SREG;
+  cli();
+  SPISerial **ppLink = &s_pFirst;
+  while (*ppLink != NULL && *ppLink != this)
+    ppLink = &(*ppLink)->m_pNext;
+  if (*ppLink != NULL)
+    *ppLink = m_pNext;
+  SREG = uSREGEntry;
 }
 
-void SPISerial::begin( unsigned long uBaudRate )
+bool SPISerial::begin( unsigned long uBaudRate )
 {
+  uint16_t uDivisor;
+  bool bPrescale;
+  if (!SolveBaudRate(m_uCrystalFrequency, uBaudRate, uDivisor, bPrescale, m_uActualBaudRate))
+  {
+    m_uActualBaudRate = 0;
+    return false;
+  }
+  const uint8_t uModemControl = bPrescale ? MCREH_DIVIDE_BY_4 : MCREH_DIVIDE_BY_1;
+  m_uModemControl = uModemControl;
+
   //SPI interface will run at 1MHz if 8MHz chip or 2Mhz if 16Mhz
   //Data is clocked on the rising edge and clock is low when inactive
-  SPI.begin();
-  SPI.setBitOrder(MSBFIRST);  
-  SPI.setClockDivider(SPI_CLOCK_DIV8); 
-  SPI.setDataMode(SPI_MODE0);
-
-  // Configure chip select pin. 
-  pinMode(m_uChipSelectPin, OUTPUT);  
-  Select(false);
+  m_SPI.Begin();
 
   // Configure interrupt pin. 
   pinMode(m_uInterruptPin, INPUT_PULLUP);
 
-  // Software reset
-  WriteRegister(REG_IO_CONTROL, IOCTRL_SW_RESET);
-  delay(50); // give a little time for the reset. 
+  // The scratchpad holds a marker for the settings we wrote. If it and the
+  // line control register still match, the chip hasn't been reset since. 
+  const uint8_t uLineControl = LCR_NO_PARITY | LCR_8_BIT_WORD_1_STOP;
+  uint8_t uMarker = (uint8_t)(WarmStart::Checksum(&uDivisor, sizeof(uDivisor)) ^ uModemControl);
+  SPISerialWarmChannel *pWarm = FindWarmChannel(m_uChipSelectPin, m_uChannel, false);
+  if (pWarm != NULL && pWarm->m_uDivisor == uDivisor && pWarm->m_uModemControl == uModemControl
+    && ReadRegister(REG_SCRATCHPAD) == uMarker && ReadRegister(REG_LINE_CONTROL) == uLineControl)
+  {
+    WriteReceiveTrigger(m_uReceiveTrigger);
+    WriteRegister(REG_INTERRUPT_ENABLE, m_uInterruptEnable);
+    AttachInterrupt();
+
+    // The interrupt line may already be low with data waiting, in which 
+    // case there won't be an edge to tell us. 
+    InterruptHandler();
+    return true;
+  }
+  if (pWarm != NULL)
+  {
+    pWarm->m_uChipSelectPin = SPISER_UNUSED_PIN;
+    s_WarmState.Save();
+  }
+
+  // Software reset. It resets the whole chip, so on a dual uart only 
+  // channel 0 does it; start channel 0 first. 
+  if (m_uChannel == 0)
+  {
+    WriteRegister(REG_IO_CONTROL, IOCTRL_SW_RESET);
+    delay(50); // give a little time for the reset. 
+  }
 
 
   // Configure UART baud rate, parity, stop bits, bits in a word... 
-  uint32_t uDivider = (SPISER_XTAL_FREQ / 16) / uBaudRate;
-  uint8_t uControl = LCR_NO_PARITY | LCR_8_BIT_WORD_1_STOP;
   WriteRegister(REG_LINE_CONTROL, LCR_EN_DIVISOR_LATCH | LCR_NO_PARITY | LCR_8_BIT_WORD_1_STOP); // latches divider. 
-  WriteRegister(REGS_DIVIDER_LOW, uDivider & 0xff);
-  WriteRegister(REGS_DIVIDER_HIGH, (uDivider >> 8) & 0xff);
+  WriteRegister(REGS_DIVIDER_LOW, uDivisor & 0xff);
+  WriteRegister(REGS_DIVIDER_HIGH, (uDivisor >> 8) & 0xff);
 
   // Configure fifos.
 
@@ -61,20 +193,92 @@ void SPISerial::begin( unsigned long uBaudRate )
   EnableEnhancedFeatures();
 
   // Configure interrupts.
-  WriteRegister(REG_INTERRUPT_ENABLE, IER_RX_FIFO_THRESHOLD);
+  WriteRegister(REG_INTERRUPT_ENABLE, m_uInterruptEnable);
 
-  WriteRegister(REG_MODEM_CONTROL, MCREH_DIVIDE_BY_1 | MCREH_EN_FIFO_TRIGGER);
-  WriteRegister(REG_FIFO_CONTROL, FCR_RX_TRIGGER_56_CHAR | 
+  // The prescaler needs enhanced features. TCR/TLR stay hidden 
+  // (MCREH_EN_FIFO_TRIGGER clear) so the scratchpad is reachable. 
+  WriteRegister(REG_MODEM_CONTROL, uModemControl);
+  // The transmit interrupt asks for more data when half the fifo is free. 
+  WriteRegister(REG_FIFO_CONTROL, FCR_RX_TRIGGER_56_CHAR | FCR_TX_TRIGGER_32_SPACES |
     FCR_RESET_TX_FIFO | FCR_RESET_RX_FIFO | FCR_ENABLE_FIFOS);
-  WriteRegister(REG_LINE_CONTROL, LCR_NO_PARITY | LCR_8_BIT_WORD_1_STOP);
+  WriteReceiveTrigger(m_uReceiveTrigger);
+  WriteRegister(REG_LINE_CONTROL, uLineControl);
+  WriteRegister(REG_SCRATCHPAD, uMarker);
+
+  pWarm = FindWarmChannel(m_uChipSelectPin, m_uChannel, true);
+  if (pWarm != NULL)
+  {
+    pWarm->m_uDivisor = uDivisor;
+    pWarm->m_uModemControl = uModemControl;
+    s_WarmState.Save();
+  }
 
-  s_pThis = this;
-  attachInterrupt(m_uInterruptChannel, InterruptHandler, FALLING);
+  AttachInterrupt();
+  return true;
+}
+
+void SPISerial::AttachInterrupt()
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+  SPISerial *pSerial = s_pFirst;
+  while (pSerial != NULL && pSerial != this)
+    pSerial = pSerial->m_pNext;
+  if (pSerial == NULL)
+  {
+    m_pNext = s_pFirst;
+    s_pFirst = this;
+  }
+  SREG = uSREGEntry;
+
+  // Every channel shares the one handler, which checks them all, so 
+  // several can share an interrupt line. 
+#ifdef digitalPinToInterrupt
+  attachInterrupt(digitalPinToInterrupt(m_uInterruptPin), InterruptHandler, FALLING);
+#else
+  attachInterrupt(m_uInterruptPin - 2, InterruptHandler, FALLING);
+#endif
+}
+
+bool SPISerial::SolveBaudRate( uint32_t uCrystalFrequency, uint32_t uBaudRate, 
+  uint16_t &ruDivisor, bool &rbPrescale, uint32_t &ruActualBaudRate )
+{
+  // baud = crystal / (prescaler * 16 * divisor), with prescaler 1 or 4. Try
+  // both with the divisor rounded to nearest and keep the closest. 
+  if (uBaudRate == 0)
+    return false;
+
+  uint32_t uBestError = 0xffffffffUL;
+  for (uint8_t uPrescaler = 1; uPrescaler <= 4; uPrescaler += 3)
+  {
+    uint32_t uClock = uCrystalFrequency / (16UL * uPrescaler);
+    uint32_t uDivisor = (uClock + uBaudRate / 2) / uBaudRate;
+    if (uDivisor == 0)
+      uDivisor = 1;
+    else if (uDivisor > 0xffff)
+      uDivisor = 0xffff;
+
+    uint32_t uActual = uCrystalFrequency / (16UL * uPrescaler * uDivisor);
+    uint32_t uError = uActual > uBaudRate ? uActual - uBaudRate : uBaudRate - uActual;
+    if (uError < uBestError)
+    {
+      uBestError = uError;
+      ruDivisor = (uint16_t)uDivisor;
+      rbPrescale = uPrescaler == 4;
+      ruActualBaudRate = uActual;
+    }
+  }
+
+  return uBestError * 1000 <= uBaudRate * SPISER_BAUD_TOLERANCE_PERMILLE;
 }
 
 int SPISerial::available()
 {
-  return m_ReceiveBuffer.IsEmpty() ? 0 : 1;
+  uint8_t uSREGEntry = SREG;
+  cli();
+  int nAvailable = m_ReceiveBuffer.Count();
+  SREG = uSREGEntry;
+  return nAvailable;
 }
 
 int SPISerial::read()
@@ -84,10 +288,11 @@ int SPISerial::read()
   int nResult = -1;
   if (!m_ReceiveBuffer.IsEmpty())
   { 
-    nResult = *m_ReceiveBuffer.Tail();
-    m_ReceiveBuffer.PopTail();
+    nResult = m_ReceiveBuffer.Remove();
+    ConsumeStamps(1);
   }
   SREG = uSREGEntry;
+  ResumeReceive();
   return nResult;
 }
 
@@ -98,15 +303,337 @@ int SPISerial::peek()
   int nResult = -1;
   if (!m_ReceiveBuffer.IsEmpty())
   { 
-    nResult = *m_ReceiveBuffer.Tail();
+    nResult = m_ReceiveBuffer.Peek();
   }
   SREG = uSREGEntry;
   return nResult;
 }
 
-void SPISerial::flush()
+size_t SPISerial::readBytes( char *pBuffer, size_t uLength )
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+  size_t uRead = m_ReceiveBuffer.Remove((uint8_t *)pBuffer, uLength);
+  ConsumeStamps(uRead);
+  SREG = uSREGEntry;
+  ResumeReceive();
+
+  if (uRead < uLength)
+    uRead += Stream::readBytes(pBuffer + uRead, uLength - uRead);
+  return uRead;
+}
+
+void SPISerial::ResetErrorCounts()
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+  m_uDropped = 0;
+  m_uOverruns = 0;
+  m_uLineErrors = 0;
+  m_uFrameErrors = 0;
+  SREG = uSREGEntry;
+}
+
+void SPISerial::SetFraming( FrameMode Mode, uint8_t uDelimiter /*= '\n'*/ )
+{
+  SharedSPI::CBusLock::Acquire();
+  uint8_t uSREGEntry = SREG;
+  cli();
+#if SPISER_MAX_FRAMES > 0
+  m_FrameMode = Mode;
+#else
+  m_FrameMode = Frame_None;
+#endif
+  m_uDelimiter = uDelimiter;
+  ClearReceived();
+  SREG = uSREGEntry;
+  SharedSPI::CBusLock::Release();
+
+  ResumeReceive();
+}
+
+uint8_t SPISerial::FramesAvailable() const
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+  uint8_t uFrames = m_uFrameCount;
+  SREG = uSREGEntry;
+  return uFrames;
+}
+
+bool SPISerial::GetFrame( Frame &rFrame ) const
+{
+  // The interrupt handler only adds after the frame, so it stays valid 
+  // once we let go. 
+  uint8_t uSREGEntry = SREG;
+  cli();
+  bool bFound = m_uFrameCount != 0;
+#if SPISER_MAX_FRAMES > 0
+  if (bFound)
+  {
+    m_ReceiveBuffer.GetSpan(m_auFrameLengths[m_uFirstFrame], rFrame.m_puFirst, rFrame.m_uFirstLength, 
+      rFrame.m_puSecond, rFrame.m_uSecondLength);
+    rFrame.m_uArrivalTime = m_auFrameTimes[m_uFirstFrame];
+  }
+#endif
+  SREG = uSREGEntry;
+  return bFound;
+}
+
+void SPISerial::ReleaseFrame()
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+#if SPISER_MAX_FRAMES > 0
+  if (m_uFrameCount != 0)
+  {
+    m_ReceiveBuffer.Skip(m_auFrameLengths[m_uFirstFrame]);
+    if (++m_uFirstFrame == MAX_FRAMES)
+      m_uFirstFrame = 0;
+    --m_uFrameCount;
+  }
+#endif
+  SREG = uSREGEntry;
+  ResumeReceive();
+}
+
+void SPISerial::SetArrivalClock( ArrivalClock pfnClock )
+{
+  SharedSPI::CBusLock::Acquire();
+  uint8_t uSREGEntry = SREG;
+  cli();
+  m_pfnArrivalClock = pfnClock;
+  ClearReceived();
+  SREG = uSREGEntry;
+  SharedSPI::CBusLock::Release();
+
+  ResumeReceive();
+}
+
+bool SPISerial::GetArrivalTime( uint32_t &ruTime ) const
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+  bool bFound = m_uStampCount != 0;
+#if SPISER_MAX_STAMPS > 0
+  if (bFound)
+    ruTime = m_auStampTimes[m_uFirstStamp];
+#endif
+  SREG = uSREGEntry;
+  return bFound;
+}
+
+void SPISerial::AddStamp( uint16_t uLength, uint32_t uTime )
+{
+  // Called from the interrupt handler. When there's no room, the newest 
+  // stamp takes the bytes too; its time is earlier than theirs. 
+#if SPISER_MAX_STAMPS > 0
+  bool bFull = m_uStampCount == MAX_STAMPS;
+  uint8_t uIndex = m_uFirstStamp + m_uStampCount - (bFull ? 1 : 0);
+  if (uIndex >= MAX_STAMPS)
+    uIndex -= MAX_STAMPS;
+
+  if (bFull)
+    m_auStampLengths[uIndex] += uLength;
+  else
+  {
+    m_auStampLengths[uIndex] = uLength;
+    m_auStampTimes[uIndex] = uTime;
+    ++m_uStampCount;
+  }
+#else
+  (void)uLength;
+  (void)uTime;
+#endif
+}
+
+void SPISerial::ConsumeStamps( uint16_t uLength )
+{
+  // Called with interrupts off as bytes are taken from the receive buffer.
+#if SPISER_MAX_STAMPS > 0
+  while (uLength != 0 && m_uStampCount != 0)
+  {
+    uint16_t &ruStampLength = m_auStampLengths[m_uFirstStamp];
+    if (ruStampLength > uLength)
+    {
+      ruStampLength -= uLength;
+      return;
+    }
+
+    uLength -= ruStampLength;
+    if (++m_uFirstStamp == MAX_STAMPS)
+      m_uFirstStamp = 0;
+    --m_uStampCount;
+  }
+#else
+  (void)uLength;
+#endif
+}
+
+void SPISerial::ClearReceived()
+{
+  // Called with interrupts off. 
+  m_ReceiveBuffer.Clear();
+  ResetFraming();
+  m_uFirstStamp = 0;
+  m_uStampCount = 0;
+}
+
+void SPISerial::ResetFraming()
+{
+  m_uFrameState = 0;
+  m_uCobsCode = 0xff;
+  m_bDiscardFrame = false;
+  m_uPartialLength = 0;
+  m_uFirstFrame = 0;
+  m_uFrameCount = 0;
+}
+
+void SPISerial::FrameByte( uint8_t uData )
+{
+  // Called from the interrupt handler for each byte received while framing.
+  switch (m_FrameMode)
+  {
+  case Frame_Delimiter:
+    if (uData == m_uDelimiter)
+    {
+      EndFrame(true);
+      return;
+    }
+    break;
+
+  case Frame_Slip:
+    if (uData == SLIP_END)
+    {
+      EndFrame(m_uFrameState == 0);
+      return;
+    }
+    if (m_uFrameState != 0)
+    {
+      m_uFrameState = 0;
+      if (uData == SLIP_ESC_END)
+        uData = SLIP_END;
+      else if (uData == SLIP_ESC_ESC)
+        uData = SLIP_ESC;
+      else
+      {
+        // Bad escape; the frame is no good. 
+        if (!m_bDiscardFrame)
+          Increment(m_uFrameErrors);
+        DropPartialFrame();
+        m_bDiscardFrame = true;
+        return;
+      }
+    }
+    else if (uData == SLIP_ESC)
+    {
+      m_uFrameState = 1;
+      return;
+    }
+    break;
+
+  case Frame_Cobs:
+    if (uData == 0)
+    {
+      EndFrame(m_uFrameState == 0);
+      return;
+    }
+    if (m_uFrameState == 0)
+    {
+      // A code byte. It stands for a zero, except after a full block or at
+      // the start of the frame. 
+      uint8_t uPrevious = m_uCobsCode;
+      m_uCobsCode = uData;
+      m_uFrameState = uData - 1;
+      if (uPrevious == 0xff)
+        return;
+      uData = 0;
+    }
+    else
+      --m_uFrameState;
+    break;
+
+  default:
+    break;
+  }
+
+  StoreFrameByte(uData);
+}
+
+void SPISerial::StoreFrameByte( uint8_t uData )
+{
+  if (m_bDiscardFrame)
+    return;
+
+  if (m_uPartialLength == 0)
+    m_uPartialTime = m_uReadTime;
+
+  if (m_ReceiveBuffer.Add(uData))
+    ++m_uPartialLength;
+  else
+  {
+    DropPartialFrame();
+    m_bDiscardFrame = true;
+    Increment(m_uDropped);
+  }
+}
+
+void SPISerial::EndFrame( bool bValid )
+{
+  if (m_bDiscardFrame)
+    ; // Already dropped and counted. 
+  else if (!bValid)
+  {
+    DropPartialFrame();
+    Increment(m_uFrameErrors);
+  }
+  else if (m_uFrameCount == MAX_FRAMES)
+  {
+    DropPartialFrame();
+    Increment(m_uDropped);
+  }
+#if SPISER_MAX_FRAMES > 0
+  else if (m_uPartialLength != 0)
+  {
+    uint8_t uIndex = m_uFirstFrame + m_uFrameCount;
+    if (uIndex >= MAX_FRAMES)
+      uIndex -= MAX_FRAMES;
+    m_auFrameLengths[uIndex] = m_uPartialLength;
+    m_auFrameTimes[uIndex] = m_uPartialTime;
+    ++m_uFrameCount;
+  }
+#endif
+
+  m_uFrameState = 0;
+  m_uCobsCode = 0xff;
+  m_bDiscardFrame = false;
+  m_uPartialLength = 0;
+}
+
+void SPISerial::DropPartialFrame()
 {
+  m_ReceiveBuffer.RemoveNewest(m_uPartialLength);
+  m_uPartialLength = 0;
+}
 
+uint16_t SPISerial::ReadCount( const uint16_t &ruCount )
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+  uint16_t uCount = ruCount;
+  SREG = uSREGEntry;
+  return uCount;
+}
+
+void SPISerial::Increment( uint16_t &ruCount )
+{
+  if (ruCount != 0xffff)
+    ++ruCount;
+}
+
+void SPISerial::flush()
+{
+  WaitForTransmitter(false);
 }
 
 size_t SPISerial::write( uint8_t uData)
@@ -117,91 +644,466 @@ size_t SPISerial::write( uint8_t uData)
   if (m_LastTxError != TxErr_None)
     return 0; 
 
-  uint32_t uStartTime = millis();
-  bool bTimeout; 
-  uint8_t uLevel;
-
-  do 
-  {
-    uLevel = ReadRegister(REG_TX_FIFO_LEVEL);
-    bTimeout = m_uTransmitTimeout > 0 && (millis() - uStartTime) > m_uTransmitTimeout;
-
-  } while (uLevel == 0 && !bTimeout);
-
-  if (bTimeout)
+  if (!WaitForTransmitter(true))
   {
-    m_LastTxError = TxErr_Timeout;
     Serial.println(F("Timeout"));
     return 0; 
   }
 
-  WriteRegister(REG_RXTX_FIFO, uData);
+  WaitForTurnaround();
+
+  // The transmit buffer is a single producer, single consumer queue, so it
+  // doesn't need interrupts off. 
+  m_TransmitBuffer.Add(uData);
+
+  // The interrupt handler turns the transmit interrupt off once the buffer
+  // is empty. Read the enable bits only after the byte is in the buffer: if
+  // the handler turned the interrupt off before seeing it, we turn it back on. 
+  CIRCULAR_BUFFER_BARRIER();
+  if (!(m_uInterruptEnable & IER_TX_FIFO_THRESHOLD))
+    EnableInterrupt(IER_TX_FIFO_THRESHOLD, true);
 
   return 1; 
 }
 
-void SPISerial::Select( bool bSelect )
+size_t SPISerial::write( const uint8_t *puData, size_t uSize )
 {
-  digitalWrite(m_uChipSelectPin, bSelect ? LOW : HIGH);
+  size_t uSent = 0;
+
+  WaitForTurnaround();
+
+  // Nothing queued means the fifo can take data now without getting ahead 
+  // of anything. Holding the bus keeps the interrupt handler out meanwhile. 
+  SharedSPI::CBusLock::Acquire();
+  if (m_bTransmitterEnabled && m_LastTxError == TxErr_None && m_TransmitBuffer.IsEmpty())
+  {
+    uint8_t uSpace = ReadRegister(REG_TX_FIFO_LEVEL);
+    uSent = uSize < uSpace ? uSize : uSpace;
+    if (uSent > 0)
+    {
+      m_SPI.BurstWrite(Address(REG_RXTX_FIFO), puData, uSent);
+      SPISER_COUNT(m_uSPIBytes, 1 + uSent);
+      SPISER_COUNT(m_uPayloadBytes, uSent);
+    }
+  }
+  SharedSPI::CBusLock::Release();
+
+  while (uSent < uSize && write(puData[uSent]))
+    ++uSent;
+
+  return uSent;
 }
 
-uint8_t SPISerial::ReadRegister(uint8_t uRegister)
+bool SPISerial::WaitForTransmitter( bool bBufferSpace )
+  /* Waits for space in the transmit buffer or, if bBufferSpace is false, 
+  for everything to be sent. Returns false on timeout. */
 {
-  uint8_t uResult;
+  uint32_t uStartTime = millis();
+
+  for (;;)
+  {
+    uint8_t uSREGEntry = SREG;
+    int nStored = m_TransmitBuffer.CountStored();
+
+    if (bBufferSpace ? nStored < TX_BUFFER_SIZE 
+      : nStored == 0 && (ReadRegister(REG_LINE_STATUS) & LSR_TX_EMPTY))
+      return true;
 
+    // With interrupts off the handler can't empty the buffer for us. 
+    if (!(uSREGEntry & _BV(SREG_I)) && nStored > 0 && SharedSPI::CBusLock::TryAcquire())
+    {
+      TransmitToFifo();
+      SharedSPI::CBusLock::Release();
+    }
+
+    if (m_uTransmitTimeout > 0 && (millis() - uStartTime) > m_uTransmitTimeout)
+    {
+      m_LastTxError = TxErr_Timeout;
+      return false;
+    }
+  }
+}
+
+uint8_t SPISerial::ReadRegister(uint8_t uRegister)
+{
   // SC16IS740 expects a R/W  bit first, followed by the 4 bit
   // register address of the byte.
-  uRegister = uRegister << 3;
-  uint8_t uSend = uRegister | SPISER_READ;
+  SPISER_COUNT(m_uSPIBytes, 2);
+  return m_SPI.Read(Address(uRegister));
+} 
+
+void SPISerial::WriteRegister( uint8_t uRegister, uint8_t uData )
+{
+  SPISER_COUNT(m_uSPIBytes, 2);
+  m_SPI.Write(Address(uRegister), uData);
+}
+
+void SPISerial::SetFlowControl( uint8_t uFlowControl, uint8_t uHaltLevel /*= 60*/, uint8_t uResumeLevel /*= 32*/, 
+  uint8_t uXon /*= 0x11*/, uint8_t uXoff /*= 0x13*/ )
+{
+  uint8_t uFeatures = EFR_ENHANCED_FUNCTIONS;
+  if (uFlowControl & Flow_Hardware)
+    uFeatures |= EFR_AUTO_RTS | EFR_AUTO_CTS;
+  if (uFlowControl & Flow_Software)
+    uFeatures |= EFR_TX_XON1_XOFF1 | EFR_RX_XON1_XOFF1;
+
+  // TCR holds the levels in units of 4 bytes: resume in the top nibble, 
+  // halt in the bottom. 
+  uint8_t uLevels = ((uResumeLevel >> 2) << 4) | ((uHaltLevel >> 2) & 0x0f);
+
+  // Hold the bus throughout so the interrupt handler doesn't see the chip
+  // with the special registers switched in. 
+  SharedSPI::CBusLock::Acquire();
+
+  uint8_t uLineControl = ReadRegister(REG_LINE_CONTROL);
+  WriteRegister(REG_LINE_CONTROL, LCR_ENHANCED_MODE);
+  WriteRegister(REGEH_XON1, uXon);
+  WriteRegister(REGEH_XOFF1, uXoff);
+  WriteRegister(REGEH_ENHANCED_FEATURES, uFeatures);
+  WriteRegister(REG_LINE_CONTROL, uLineControl);
+
+  // TCR is only reachable while MCR[2] is set, and it hides the scratchpad. 
+  uint8_t uModemControl = ReadRegister(REG_MODEM_CONTROL);
+  WriteRegister(REG_MODEM_CONTROL, uModemControl | MCREH_EN_FIFO_TRIGGER);
+  WriteRegister(REGT_TRANSMISSION_CONTROL, uLevels);
+  WriteRegister(REG_MODEM_CONTROL, uModemControl & ~MCREH_EN_FIFO_TRIGGER);
+
+  m_uFlowControl = uFlowControl;
 
+  SharedSPI::CBusLock::Release();
+
+  ResumeReceive();
+}
+
+void SPISerial::SetLoopback( bool bEnable )
+{
+  SharedSPI::CBusLock::Acquire();
+  m_uModemControl = bEnable ? m_uModemControl | MCR_LOOPBACK : m_uModemControl & ~MCR_LOOPBACK;
+  WriteRegister(REG_MODEM_CONTROL, m_uModemControl);
+  SharedSPI::CBusLock::Release();
+}
+
+#ifdef SPISER_MEASURE
+void SPISerial::GetStatistics( Statistics &rStatistics ) const
+{
   uint8_t uSREGEntry = SREG;
   cli();
+  rStatistics = m_Statistics;
+  SREG = uSREGEntry;
+}
 
-  Select(true);
-  SPI.transfer(uSend); // Send register location
-  uResult = SPI.transfer(0);  // Get Value from register
-  Select(false);
-
+void SPISerial::ResetStatistics()
+{
+  uint8_t uSREGEntry = SREG;
+  cli();
+  memset(&m_Statistics, 0, sizeof(m_Statistics));
   SREG = uSREGEntry;
+}
+#endif
 
-  return uResult;
-} 
+void SPISerial::SetRS485( bool bEnable, bool bInvertRTS /*= false*/, uint16_t uTurnaroundMicros /*= 0*/ )
+{
+  SharedSPI::CBusLock::Acquire();
+  uint8_t uExtraFeatures = ReadRegister(REG_EXTRA_FEATURES_CONTROL) & ~(EFCR_RTS_CONTROL | EFCR_RTS_INVERT);
+  if (bEnable)
+  {
+    uExtraFeatures |= EFCR_RTS_CONTROL;
+    if (bInvertRTS)
+      uExtraFeatures |= EFCR_RTS_INVERT;
+  }
+  WriteRegister(REG_EXTRA_FEATURES_CONTROL, uExtraFeatures);
+  m_uTurnaroundMicros = bEnable ? uTurnaroundMicros : 0;
+  SharedSPI::CBusLock::Release();
+}
 
-void SPISerial::WriteRegister( uint8_t uRegister, uint8_t uData )
+void SPISerial::WaitForTurnaround()
 {
-  // SC16IS740 expects a R/W  bit first, followed by the 4 bit
-  // register address of the byte.
-  uRegister = uRegister << 3;
-  uint8_t uSend = uRegister | SPISER_WRITE;
+  // The chip switches the driver on as soon as it has data, so hold back 
+  // the first byte until the other end has had time to let go of the bus.
+  // We took the last data some time after it arrived, so this errs long. 
+  if (m_uTurnaroundMicros == 0 || !m_TransmitBuffer.IsEmpty())
+    return;
 
   uint8_t uSREGEntry = SREG;
   cli();
+  uint32_t uLastReceive = m_uLastReceiveMicros;
+  SREG = uSREGEntry;
+
+  uint32_t uElapsed = micros() - uLastReceive;
+  if (uElapsed < m_uTurnaroundMicros)
+    delayMicroseconds(m_uTurnaroundMicros - uElapsed);
+}
+
+void SPISerial::SetReceiveMode( ReceiveMode Mode )
+{
+  uint8_t uTrigger;
+  switch (Mode)
+  {
+  case Receive_LowLatency:
+    uTrigger = RX_TRIGGER_MIN;
+    break;
+  case Receive_Bulk:
+    uTrigger = RX_TRIGGER_MAX;
+    break;
+  default:
+    uTrigger = RX_TRIGGER_BALANCED;
+    break;
+  }
+
+  // Holding the bus keeps the interrupt handler from adapting the trigger 
+  // while we change it. Before begin, just remember it. 
+  SharedSPI::CBusLock::Acquire();
+  m_ReceiveMode = Mode;
+  m_uTriggerStreak = 0;
+  if (m_uActualBaudRate != 0)
+    WriteReceiveTrigger(uTrigger);
+  else
+    m_uReceiveTrigger = uTrigger;
+  SharedSPI::CBusLock::Release();
+}
+
+void SPISerial::WriteReceiveTrigger( uint8_t uTrigger )
+{
+  // Called holding the bus. TLR is only reachable while MCR[2] is set, and
+  // it hides the scratchpad. The tx trigger is left to FCR. 
+  m_uReceiveTrigger = uTrigger;
+  WriteRegister(REG_MODEM_CONTROL, m_uModemControl | MCREH_EN_FIFO_TRIGGER);
+  WriteRegister(REGT_TRIGGER_LEVEL, (uTrigger / RX_TRIGGER_STEP) << TLR_RX_TRIGGER_SHIFT);
+  WriteRegister(REG_MODEM_CONTROL, m_uModemControl);
+}
+
+void SPISerial::AdaptReceiveTrigger( uint8_t uLevel, bool bTimeout )
+{
+  // Called from the interrupt handler with the receive fifo level it found.
+  uint8_t uTrigger = m_uReceiveTrigger;
+  if (bTimeout)
+  {
+    // The sender stopped short of the trigger, so messages are smaller than
+    // it. Follow them down so the next one doesn't wait for the timeout. 
+    m_uTriggerStreak = 0;
+    if (uLevel < uTrigger)
+      uTrigger = uLevel < RX_TRIGGER_MIN ? RX_TRIGGER_MIN : uLevel & ~(RX_TRIGGER_STEP - 1);
+  }
+  else
+  {
+    // What arrived after the trigger is the arrival rate times our latency
+    // and service cost. Keep room for twice that above the trigger, and 
+    // only raise it after a run of interrupts that had room to spare. 
+    uint8_t uOvershoot = uLevel > uTrigger ? uLevel - uTrigger : 0;
+    if (uTrigger + 2 * uOvershoot + RX_TRIGGER_STEP > RX_FIFO_SIZE)
+    {
+      m_uTriggerStreak = 0;
+      if (uTrigger > RX_TRIGGER_MIN)
+        uTrigger -= RX_TRIGGER_STEP;
+    }
+    else if (++m_uTriggerStreak >= RX_TRIGGER_STREAK)
+    {
+      m_uTriggerStreak = 0;
+      if (uTrigger < RX_TRIGGER_MAX && uTrigger + 2 * uOvershoot + 2 * RX_TRIGGER_STEP <= RX_FIFO_SIZE)
+        uTrigger += RX_TRIGGER_STEP;
+    }
+  }
 
-  Select(true);
-  SPI.transfer(uSend); 
-  SPI.transfer(uData); 
-  Select(false);
+  if (uTrigger != m_uReceiveTrigger)
+    WriteReceiveTrigger(uTrigger);
+}
 
+void SPISerial::ResumeReceive()
+{
+  // Turn the receive interrupt back on once the buffer is half empty. 
+  if (m_uInterruptEnable & IER_RX_FIFO_THRESHOLD)
+    return;
+
+  uint8_t uSREGEntry = SREG;
+  cli();
+  bool bResume = m_uFlowControl == Flow_None || m_ReceiveBuffer.Count() <= m_ReceiveBuffer.Capacity() / 2;
   SREG = uSREGEntry;
+
+  if (bResume)
+    EnableInterrupt(IER_RX_FIFO_THRESHOLD, true);
 }
 
 void SPISerial::EnableEnhancedFeatures()
 {
   WriteRegister(REG_LINE_CONTROL, LCR_ENHANCED_MODE); // needed to set fifo trigger levels & divider
-  WriteRegister(REGEH_ENHANCED_FEATURES, 0x10); // Enable enhanced functions
+  WriteRegister(REGEH_ENHANCED_FEATURES, EFR_ENHANCED_FUNCTIONS); // Enable enhanced functions
   WriteRegister(REG_LINE_CONTROL, 0);
 }
 
 void SPISerial::InterruptHandler()
 {
-  if (s_pThis != NULL)
+  // The interrupt line stays low until the FIFO is read, so if the bus is 
+  // busy there won't be another edge. Have the lock call us back instead. 
+  if (!SharedSPI::CBusLock::TryAcquire())
+  {
+    SharedSPI::CBusLock::Defer(InterruptHandler);
+    return;
+  }
+
+  // Each pass handles one pending source on each channel: at most one fifo
+  // read and one fifo fill. We only see falling edges and a shared line 
+  // stays low while any channel has something pending, so keep going until
+  // none do, but with interrupts on after the first pass so other handlers
+  // wait for one pass at most. If we interrupt ourselves, the bus is held,
+  // so that call is deferred until we release it. 
+  uint8_t uSREG = SREG;
+  while (ServiceChannels())
+    sei();
+  SREG = uSREG;
+
+  SharedSPI::CBusLock::Release();
+}
+
+bool SPISerial::ServiceChannels()
+{
+  bool bServiced = false;
+  for (SPISerial *pSerial = s_pFirst; pSerial != NULL; pSerial = pSerial->m_pNext)
+    if (pSerial->ServiceInterrupt())
+      bServiced = true;
+  return bServiced;
+}
+
+bool SPISerial::ServiceInterrupt()
+{
+  // Handles the highest priority source pending. Returns true if there was
+  // one. 
+  uint8_t uSource = ReadRegister(REG_SIGNALED_INTERRUPT);
+  if (uSource & IIR_NONE_PENDING)
+    return false;
+
+  // Error flags are for the byte at the front of the fifo, so check them
+  // before reading it. 
+  if ((uSource & IIR_MASK) == IIR_RX_LINE_STATUS)
+    CheckLineStatus();
+
+  ReceiveFromFifo(uSource & IIR_MASK);
+  TransmitToFifo();
+  return true;
+}
+
+void SPISerial::CheckLineStatus()
+{
+  uint8_t uStatus = ReadRegister(REG_LINE_STATUS);
+  if (uStatus & LSR_OVERRUN_ERROR)
+    Increment(m_uOverruns);
+  if (uStatus & (LSR_PARITY_ERROR | LSR_FRAMING_ERROR | LSR_BREAK))
+    Increment(m_uLineErrors);
+}
+
+void SPISerial::ReceiveFromFifo( uint8_t uSource )
+{
+  // The fifo address doesn't advance, so everything waiting can be read in
+  // one transfer. 
+  uint8_t uBytesAvailable = ReadRegister(REG_RX_LEVEL);
+
+  if (m_ReceiveMode == Receive_Adaptive 
+    && (uSource == IIR_RX_FIFO_THRESHOLD || uSource == IIR_RX_TIMEOUT))
+    AdaptReceiveTrigger(uBytesAvailable, uSource == IIR_RX_TIMEOUT);
+
+  // With flow control, leave what doesn't fit in the chip so it holds the 
+  // sender off. The receive interrupt would keep firing, so pause it until
+  // the buffer has been read. 
+  if (m_uFlowControl != Flow_None)
+  {
+    if (m_FrameMode != Frame_None)
+    {
+      // A frame bigger than the buffer would never finish; drop it rather
+      // than hold the sender off for good. 
+      if (m_uFrameCount == 0 && m_uPartialLength != 0 && m_ReceiveBuffer.IsFull())
+      {
+        DropPartialFrame();
+        m_bDiscardFrame = true;
+        Increment(m_uDropped);
+      }
+    }
+
+    uint16_t uSpace = m_ReceiveBuffer.Capacity() - m_ReceiveBuffer.Count();
+    if (m_FrameMode != Frame_None && m_uFrameCount == MAX_FRAMES)
+      uSpace = 0;
+    if (uBytesAvailable > uSpace)
+    {
+      uBytesAvailable = uSpace;
+      EnableInterrupt(IER_RX_FIFO_THRESHOLD, false);
+    }
+  }
+
+  if (uBytesAvailable == 0)
+    return;
+
+  if (m_uTurnaroundMicros != 0)
+    m_uLastReceiveMicros = micros();
+
+#ifdef SPISER_MEASURE
+  uint32_t uStartMicros = micros();
+  SPISER_COUNT(m_uSPIBytes, 1 + uBytesAvailable);
+  SPISER_COUNT(m_uPayloadBytes, uBytesAvailable);
+#endif
+
+  if (m_pfnArrivalClock != NULL)
+    m_uReadTime = m_pfnArrivalClock();
+
+  uint16_t uStored = 0;
+  m_SPI.BeginTransaction();
+  m_SPI.Transfer(Address(REG_RXTX_FIFO) | SPISER_READ);
+  while (uBytesAvailable--)
+  {
+    uint8_t uData = m_SPI.Transfer(0);
+    if (m_FrameMode != Frame_None)
+      FrameByte(uData);
+    else if (m_ReceiveBuffer.Add(uData))
+      ++uStored;
+    else
+      Increment(m_uDropped);
+  }
+  m_SPI.EndTransaction();
+
+  if (m_pfnArrivalClock != NULL && uStored != 0)
+    AddStamp(uStored, m_uReadTime);
+
+#ifdef SPISER_MEASURE
+  SPISER_COUNT(m_uReceiveMicros, micros() - uStartMicros);
+  SPISER_COUNT(m_uReceiveReads, 1);
+#endif
+}
+
+void SPISerial::TransmitToFifo()
+{
+  // Called with interrupts off, holding the bus. 
+  if (!m_TransmitBuffer.IsEmpty())
   {
-    uint8_t uBytesAvailable = s_pThis->ReadRegister(REG_RX_LEVEL);
-    while (uBytesAvailable--)
+    uint8_t uSpace = ReadRegister(REG_TX_FIFO_LEVEL);
+    if (uSpace > 0)
     {
-      s_pThis->m_ReceiveBuffer.Add(s_pThis->ReadRegister(REG_RXTX_FIFO));
+      m_SPI.BeginTransaction();
+      m_SPI.Transfer(Address(REG_RXTX_FIFO) | SPISER_WRITE);
+      while (uSpace-- && !m_TransmitBuffer.IsEmpty())
+      {
+        m_SPI.Transfer(*m_TransmitBuffer.Tail());
+        m_TransmitBuffer.PopTail();
+        SPISER_COUNT(m_uSPIBytes, 1);
+        SPISER_COUNT(m_uPayloadBytes, 1);
+      }
+      SPISER_COUNT(m_uSPIBytes, 1);
+      m_SPI.EndTransaction();
     }
   }
+
+  if (m_TransmitBuffer.IsEmpty())
+    EnableInterrupt(IER_TX_FIFO_THRESHOLD, false);
+}
+
+void SPISerial::EnableInterrupt( uint8_t uSource, bool bEnable )
+{
+  // Holding the bus keeps the interrupt handler from changing it under us. 
+  SharedSPI::CBusLock::Acquire();
+  uint8_t uEnable = bEnable ? m_uInterruptEnable | uSource 
+    : m_uInterruptEnable & ~uSource;
+  if (uEnable != m_uInterruptEnable)
+  {
+    m_uInterruptEnable = uEnable;
+    WriteRegister(REG_INTERRUPT_ENABLE, uEnable);
+  }
+  SharedSPI::CBusLock::Release();
 }
 
 void SPISerial::EnableTransmitter( bool bEnable )
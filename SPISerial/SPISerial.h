@@ -3,17 +3,182 @@
 #include <inttypes.h>
 #include "Stream.h"
 #include "CircularBuffer.h"
+#include "ByteRing.h"
+#include "../SharedSPI/SharedSPI.h"
+
+// Bytes in the receive buffer built into each SPISerial, used when the 
+// constructor isn't given one. It costs RAM in every instance; define as 0
+// to leave it out when every instance has its own buffer. 
+#ifndef SPISER_DEFAULT_RX_BUFFER
+#define SPISER_DEFAULT_RX_BUFFER 64
+#endif
+
+// Complete frames each SPISerial can hold, at 6 bytes of RAM each. Define
+// as 0 to leave framing out; SetFraming then leaves it off. 
+#ifndef SPISER_MAX_FRAMES
+#define SPISER_MAX_FRAMES 8
+#endif
+
+// Arrival time stamps each SPISerial can hold outside framing, at 6 bytes
+// of RAM each. Define as 0 to leave them out; GetArrivalTime then always
+// returns false. Frames keep their times either way. 
+#ifndef SPISER_MAX_STAMPS
+#define SPISER_MAX_STAMPS 8
+#endif
 
 class SPISerial : public Stream
 {
 public:
-  SPISerial(uint8_t uChipSelectPin, uint8_t uInterruptPin);
+  // uChannel picks the uart on a dual SC16IS752 (0 or 1); both channels 
+  // share the chip select and interrupt pins. Any number of channels can
+  // share an interrupt pin. Received data waits in puReceiveBuffer, if 
+  // given. Otherwise the built-in SPISER_DEFAULT_RX_BUFFER byte buffer is 
+  // used; with none, everything received is dropped. 
+  SPISerial(uint8_t uChipSelectPin, uint8_t uInterruptPin, uint8_t uChannel = 0, 
+    uint8_t *puReceiveBuffer = NULL, uint16_t uReceiveBufferSize = 0);
   ~SPISerial();
 
-  void begin(unsigned long uBaudRate);
+  // Returns false if the baud rate can't be made from the crystal within 
+  // 1.5%. 
+  bool begin(unsigned long uBaudRate);
+
+  // The crystal on the SC16IS7xx; 14.7456 MHz unless set before begin. 
+  void SetCrystalFrequency(uint32_t uHz) { m_uCrystalFrequency = uHz; }
+
+  // Baud rate the chip is really running at, or 0 if begin failed. 
+  uint32_t GetActualBaudRate() const { return m_uActualBaudRate; }
+
+  // Finds the divisor and prescaler (by 4 if rbPrescale) giving the baud
+  // rate closest to uBaudRate. Returns false if it isn't close enough. 
+  static bool SolveBaudRate(uint32_t uCrystalFrequency, uint32_t uBaudRate, 
+    uint16_t &ruDivisor, bool &rbPrescale, uint32_t &ruActualBaudRate);
 
   void EnableTransmitter(bool bEnable);
 
+  // Flow control options; hardware and software can be combined. 
+  enum FlowControl
+  {
+    Flow_None = 0, 
+    Flow_Hardware = 0x01, // RTS/CTS
+    Flow_Software = 0x02, // XON/XOFF
+  };
+
+  // Turns flow control on or off; call after begin. The chip handles it: 
+  // it stops the sender (deasserts RTS or sends XOFF) when its receive fifo 
+  // holds uHaltLevel bytes and lets it go again at uResumeLevel. Levels are
+  // rounded down to a multiple of 4. The halt level should be above the 
+  // receive interrupt trigger (56). While flow control is on, data that 
+  // doesn't fit in the receive buffer is left in the chip. 
+  void SetFlowControl(uint8_t uFlowControl, uint8_t uHaltLevel = 60, uint8_t uResumeLevel = 32,
+    uint8_t uXon = 0x11, uint8_t uXoff = 0x13);
+
+  // When the chip interrupts with received data. Low latency interrupts 
+  // at 4 bytes, balanced at 32 and bulk at 56 (the default). Adaptive 
+  // starts at 32 and tunes the level to the traffic: down towards the 
+  // message size when messages end short of it, down when data arrives 
+  // faster than we read it, and up when a steady stream leaves room. Data 
+  // below the level still arrives once the line has been idle for 4 
+  // characters. 
+  enum ReceiveMode
+  {
+    Receive_LowLatency,
+    Receive_Balanced,
+    Receive_Bulk,
+    Receive_Adaptive,
+  };
+
+  void SetReceiveMode(ReceiveMode Mode);
+  uint8_t GetReceiveTrigger() const { return m_uReceiveTrigger; }
+
+  // Frames can be picked out of the received data as it arrives. Delimiter
+  // frames end at a chosen byte; SLIP and COBS frames are decoded. Frame 
+  // ends, and empty frames, aren't stored. While framing is on, use the 
+  // frame functions rather than read. 
+  enum FrameMode
+  {
+    Frame_None, 
+    Frame_Delimiter, 
+    Frame_Slip, 
+    Frame_Cobs,
+  };
+
+  // A received frame, in place in the receive buffer. It wraps around the 
+  // end of the buffer when m_uSecondLength isn't 0. 
+  struct Frame
+  {
+    const uint8_t *m_puFirst;
+    uint16_t m_uFirstLength;
+    const uint8_t *m_puSecond;
+    uint16_t m_uSecondLength;
+    uint32_t m_uArrivalTime; // See SetArrivalClock. 
+
+    uint16_t Length() const { return m_uFirstLength + m_uSecondLength; }
+  };
+
+  // Turns framing on or off, discarding anything received. Framing stays
+  // off if SPISER_MAX_FRAMES is 0. 
+  void SetFraming(FrameMode Mode, uint8_t uDelimiter = '\n');
+
+  // Complete frames waiting. 
+  uint8_t FramesAvailable() const;
+
+  // The oldest complete frame. It stays put until ReleaseFrame. Returns 
+  // false if there isn't one. 
+  bool GetFrame(Frame &rFrame) const;
+  void ReleaseFrame();
+
+  // RS-485 half duplex. The chip drives RTS as the line driver enable, 
+  // switching it on with the first start bit and off after the last stop 
+  // bit. RTS is low while transmitting unless bInvertRTS is set. Don't 
+  // combine with hardware flow control. After receiving, writes wait 
+  // until uTurnaroundMicros have passed so the other end can release the
+  // bus. Call after begin. 
+  void SetRS485(bool bEnable, bool bInvertRTS = false, uint16_t uTurnaroundMicros = 0);
+
+  // Received data can be stamped with its arrival time from pfnClock 
+  // (micros, millis or a function returning RealTimeClock::GetMilliSeconds,
+  // say). The clock is read once each time the interrupt handler empties 
+  // the chip's fifo, so the time is within the receive trigger or timeout
+  // of the data arriving. Frames get the time their first byte was read.
+  // Discards anything received; NULL turns stamping off. 
+  typedef uint32_t (*ArrivalClock)();
+  void SetArrivalClock(ArrivalClock pfnClock);
+
+  // When the next byte read arrived. Returns false if there isn't one or 
+  // it wasn't stamped. 
+  bool GetArrivalTime(uint32_t &ruTime) const;
+
+  // Connects the transmitter to the receiver inside the chip, and the 
+  // modem outputs to its inputs, for self tests. begin turns it off. 
+  void SetLoopback(bool bEnable);
+
+#ifdef SPISER_MEASURE
+  // Define SPISER_MEASURE to count the SPI traffic and receive handling 
+  // time, and to build the loopback and buffer benchmarks. 
+  struct Statistics
+  {
+    uint32_t m_uSPIBytes; // Everything clocked over SPI, including addresses. 
+    uint32_t m_uPayloadBytes; // Data through the fifos, both ways. 
+    uint32_t m_uReceiveMicros; // Time spent reading the receive fifo. 
+    uint16_t m_uReceiveReads; // Times the receive fifo was read. 
+  };
+
+  void GetStatistics(Statistics &rStatistics) const;
+  void ResetStatistics();
+
+  // Runs the port in loopback at each baud rate, streaming uLength bytes 
+  // of a pattern through it. Reports throughput, receive handling time, 
+  // SPI bytes per payload byte, the time for a single byte to come back 
+  // (which depends on the receive mode) and errors to rOut. Leaves the 
+  // port running at the last rate; call begin afterwards. Returns false if
+  // any rate was impossible, timed out or had errors. 
+  bool RunLoopbackBenchmark(Print &rOut, const unsigned long *puBaudRates, uint8_t uRates, uint16_t uLength = 2048);
+
+  // Times filling and draining the transmit buffer's CircularBuffer, in 
+  // both the general and the lock free versions. Needs no hardware. 
+  static void RunBufferBenchmark(Print &rOut, uint16_t uRounds = 100);
+#endif
+
   enum TransmitError
   {
     TxErr_None, 
@@ -26,21 +191,70 @@ public:
   virtual int peek();
   virtual void flush();
 
+  // Copies out what has already arrived in one go, then waits (up to the 
+  // stream timeout) for the rest. 
+  size_t readBytes(char *pBuffer, size_t uLength);
+  size_t readBytes(uint8_t *puBuffer, size_t uLength) { return readBytes((char *)puBuffer, uLength); }
+
+  // Receive problems since begin or ResetErrorCounts. Dropped bytes arrived
+  // when the receive buffer was full; overruns are bytes lost because the 
+  // chip's fifo was full; line errors are parity and framing errors and 
+  // breaks. Counts stop at 0xffff. 
+  uint16_t GetDroppedCount() const { return ReadCount(m_uDropped); }
+  uint16_t GetOverrunCount() const { return ReadCount(m_uOverruns); }
+  uint16_t GetLineErrorCount() const { return ReadCount(m_uLineErrors); }
+
+  // While framing, whole frames are dropped when they don't fit, and are 
+  // counted as one dropped byte. Frame errors are malformed SLIP or COBS. 
+  uint16_t GetFrameErrorCount() const { return ReadCount(m_uFrameErrors); }
+  void ResetErrorCounts();
+
   // Implementation required of Print
   virtual size_t write(uint8_t uData);
 
+  // Sends as much as fits straight to the chip's fifo in one transfer when
+  // nothing is waiting; the rest goes through the transmit buffer. 
+  virtual size_t write(const uint8_t *puData, size_t uSize);
+  using Print::write;
+
 private:
   void EnableEnhancedFeatures();
-  void Select(bool bSelect);
+  bool ServiceInterrupt();
+  void AttachInterrupt();
+  void CheckLineStatus();
+  void ReceiveFromFifo(uint8_t uSource);
+  void AdaptReceiveTrigger(uint8_t uLevel, bool bTimeout);
+  void FrameByte(uint8_t uData);
+  void StoreFrameByte(uint8_t uData);
+  void EndFrame(bool bValid);
+  void DropPartialFrame();
+  void ResetFraming();
+  void ClearReceived();
+  void AddStamp(uint16_t uLength, uint32_t uTime);
+  void ConsumeStamps(uint16_t uLength);
+  void WriteReceiveTrigger(uint8_t uTrigger);
+  void TransmitToFifo();
+  void EnableInterrupt(uint8_t uSource, bool bEnable);
+  void ResumeReceive();
+  bool WaitForTransmitter(bool bBufferSpace);
+  void WaitForTurnaround();
   uint8_t ReadRegister(uint8_t uRegister);
   void WriteRegister(uint8_t uRegister, uint8_t uData);
   static void InterruptHandler();
-  static SPISerial *s_pThis;
+  static bool ServiceChannels();
+  static uint16_t ReadCount(const uint16_t &ruCount);
+  static void Increment(uint16_t &ruCount);
+  uint8_t Address(uint8_t uRegister) const { return (uRegister << 3) | (m_uChannel << 1); }
+
+  // Started channels. 
+  static SPISerial *s_pFirst;
+  SPISerial *m_pNext;
 
 private:
   const uint8_t m_uChipSelectPin;
+  SharedSPI::CSharedSPI m_SPI;
   const uint8_t m_uInterruptPin;
-  const uint8_t m_uInterruptChannel;
+  const uint8_t m_uChannel;
 
   // Timeout for sending data. If 0, no timeout occurs. 
   uint16_t m_uTransmitTimeout;
@@ -48,13 +262,90 @@ private:
 
   TransmitError m_LastTxError; 
 
+  // Interrupts enabled on the chip. The transmit interrupt is only on while
+  // there is data waiting in the transmit buffer. The receive interrupt is 
+  // off while flow control is holding data in the chip. 
+  uint8_t m_uInterruptEnable;
+
+  uint8_t m_uFlowControl;
+
+  // RS-485 bus turnaround time and when we last took data from the chip. 
+  uint16_t m_uTurnaroundMicros;
+  uint32_t m_uLastReceiveMicros;
+
+  // Modem control as set by begin and SetLoopback, with TCR/TLR hidden. 
+  uint8_t m_uModemControl;
+
+  ReceiveMode m_ReceiveMode;
+  uint8_t m_uReceiveTrigger;
+  uint8_t m_uTriggerStreak; // Adaptive: threshold interrupts with room to spare. 
+
+  uint32_t m_uCrystalFrequency;
+  uint32_t m_uActualBaudRate;
+
   enum Constants 
   {
     RX_FIFO_SIZE = 64,
-    TX_FIFO_SIZE = 64
+    TX_FIFO_SIZE = 64,
+    TX_BUFFER_SIZE = 64,
+    RX_TRIGGER_STEP = 4, 
+    RX_TRIGGER_MIN = 4,
+    RX_TRIGGER_MAX = 56,
+    RX_TRIGGER_BALANCED = 32,
+    RX_TRIGGER_STREAK = 4,
+    MAX_FRAMES = SPISER_MAX_FRAMES,
+    MAX_STAMPS = SPISER_MAX_STAMPS,
   };
 
-  NSPISerial::CircularBuffer<uint8_t, RX_FIFO_SIZE> m_ReceiveBuffer;
+#if SPISER_DEFAULT_RX_BUFFER > 0
+  uint8_t m_auDefaultReceiveBuffer[SPISER_DEFAULT_RX_BUFFER];
+#endif
+  NSPISerial::ByteRing m_ReceiveBuffer;
+
+  uint16_t m_uDropped;
+  uint16_t m_uOverruns;
+  uint16_t m_uLineErrors;
+  uint16_t m_uFrameErrors;
+
+  FrameMode m_FrameMode;
+  uint8_t m_uDelimiter;
+
+  // SLIP: an escape is pending. COBS: bytes left in the block. 
+  uint8_t m_uFrameState;
+  uint8_t m_uCobsCode; // Code byte of the current COBS block. 
+  bool m_bDiscardFrame; // Skipping the rest of a frame that was dropped. 
+
+  // Bytes stored so far of the frame being received. 
+  uint16_t m_uPartialLength;
+
+  // Lengths of the complete frames, oldest first. 
+#if SPISER_MAX_FRAMES > 0
+  uint16_t m_auFrameLengths[MAX_FRAMES];
+  uint32_t m_auFrameTimes[MAX_FRAMES];
+#endif
+  uint8_t m_uFirstFrame;
+  uint8_t m_uFrameCount;
+
+  ArrivalClock m_pfnArrivalClock;
+  uint32_t m_uReadTime; // When the handler last emptied the fifo. 
+  uint32_t m_uPartialTime; // When the frame being received started. 
+
+  // Outside framing, one stamp per fifo read: how many bytes of the 
+  // receive buffer it covers, and when, oldest first. 
+#if SPISER_MAX_STAMPS > 0
+  uint16_t m_auStampLengths[MAX_STAMPS];
+  uint32_t m_auStampTimes[MAX_STAMPS];
+#endif
+  uint8_t m_uFirstStamp;
+  uint8_t m_uStampCount;
+
+  // Data waiting for space in the chip's transmit fifo. Filled by write, 
+  // emptied by the interrupt handler, so it is the lock free version. 
+  NSPISerial::CircularBuffer<uint8_t, TX_BUFFER_SIZE, true> m_TransmitBuffer;
+
+#ifdef SPISER_MEASURE
+  Statistics m_Statistics;
+#endif
 
 };
 
@@ -0,0 +1,40 @@
+#include "BurstTransfer.h"
+
+// SPIF is cleared by reading SPSR with it set and then accessing SPDR. 
+#define SPI_WAIT_FOR_BYTE() while (!(SPSR & _BV(SPIF))) ;
+
+namespace SharedSPI
+{
+  void SendBlock( const uint8_t *puData, uint16_t uLength )
+  {
+    if (uLength == 0)
+      return;
+
+    SPDR = *puData++;
+    while (--uLength)
+    {
+      uint8_t uNext = *puData++; // Fetched while the last byte shifts out. 
+      SPI_WAIT_FOR_BYTE();
+      SPDR = uNext;
+    }
+    SPI_WAIT_FOR_BYTE();
+    (void)SPDR;
+  }
+
+  void ReceiveBlock( uint8_t *puData, uint16_t uLength, uint8_t uFill /*= 0*/ )
+  {
+    if (uLength == 0)
+      return;
+
+    SPDR = uFill;
+    while (--uLength)
+    {
+      SPI_WAIT_FOR_BYTE();
+      uint8_t uReceived = SPDR;
+      SPDR = uFill;          // Start the next byte first...
+      *puData++ = uReceived; // ...then store this one while it shifts. 
+    }
+    SPI_WAIT_FOR_BYTE();
+    *puData = SPDR;
+  }
+}
@@ -0,0 +1,22 @@
+/* *****************************************************************************
+*  Block transfers on the SPI bus that keep the shift register busy. 
+*  SPI.transfer waits for a byte to finish before it fetches the next one, so
+*  the bus idles between bytes. These loops fetch (or store) a byte while the
+*  previous one is shifting, so at SPI_CLOCK_DIV2 the gap between bytes is 
+*  only the few cycles needed to notice SPIF and reload SPDR. 
+*
+*  The device must already be selected and the bus lock held. Interrupts can
+*  stay on: one that arrives mid-block only leaves the bus idle until it 
+*  returns, as the master clocks nothing until SPDR is written. 
+*  ***************************************************************************** */
+#pragma once
+#include <Arduino.h>
+
+namespace SharedSPI
+{
+  // Sends uLength bytes, discarding whatever comes back. 
+  void SendBlock(const uint8_t *puData, uint16_t uLength);
+
+  // Receives uLength bytes, sending uFill for each. 
+  void ReceiveBlock(uint8_t *puData, uint16_t uLength, uint8_t uFill = 0);
+}
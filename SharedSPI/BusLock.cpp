@@ -0,0 +1,122 @@
+#include "BusLock.h"
+#include "SPITransferQueue.h"
+
+namespace SharedSPI
+{
+  volatile uint8_t CBusLock::s_uDepth = 0;
+  volatile bool CBusLock::s_bQueueOwns = false;
+  CBusLock::DeferredHandler CBusLock::s_apfnDeferred[MAX_DEFERRED];
+  uint8_t CBusLock::s_uDeferred = 0;
+
+#ifdef SHARED_SPI_MEASURE_LOCK
+  uint32_t CBusLock::s_uAcquiredAt;
+  uint32_t CBusLock::s_uLongestHold = 0;
+#endif
+
+  void CBusLock::Acquire()
+  {
+    for (;;)
+    {
+      uint8_t uSREG = SREG;
+      cli();
+      if (!s_bQueueOwns)
+      {
+#ifdef SHARED_SPI_MEASURE_LOCK
+        if (s_uDepth == 0)
+          s_uAcquiredAt = micros();
+#endif
+        ++s_uDepth;
+        SREG = uSREG;
+        return;
+      }
+      SREG = uSREG;
+
+      // Run the queue ourselves if the interrupt won't. 
+      if (CSPITransferQueue::MustPoll())
+        CSPITransferQueue::Poll();
+    }
+  }
+
+  bool CBusLock::TryAcquire()
+  {
+    bool bAcquired = false;
+    uint8_t uSREG = SREG;
+    cli();
+    if (IsFree())
+    {
+#ifdef SHARED_SPI_MEASURE_LOCK
+      s_uAcquiredAt = micros();
+#endif
+      s_uDepth = 1;
+      bAcquired = true;
+    }
+    SREG = uSREG;
+    return bAcquired;
+  }
+
+  void CBusLock::Release()
+  {
+    uint8_t uSREG = SREG;
+    cli();
+    if (s_uDepth > 0 && --s_uDepth == 0)
+    {
+#ifdef SHARED_SPI_MEASURE_LOCK
+      uint32_t uHeld = micros() - s_uAcquiredAt;
+      if (uHeld > s_uLongestHold)
+        s_uLongestHold = uHeld;
+#endif
+      RunDeferred(uSREG);
+      CSPITransferQueue::StartPending();
+    }
+    SREG = uSREG;
+  }
+
+  void CBusLock::Defer( DeferredHandler pfnHandler )
+  {
+    uint8_t uSREG = SREG;
+    cli();
+    bool bFound = false;
+    for (uint8_t iHandler = 0; iHandler < s_uDeferred; ++iHandler)
+      if (s_apfnDeferred[iHandler] == pfnHandler)
+        bFound = true;
+    if (!bFound && s_uDeferred < MAX_DEFERRED)
+      s_apfnDeferred[s_uDeferred++] = pfnHandler;
+    SREG = uSREG;
+  }
+
+  bool CBusLock::TryAcquireForQueue()
+  {
+    // Called with interrupts off. 
+    if (!IsFree())
+      return false;
+    s_bQueueOwns = true;
+    return true;
+  }
+
+  void CBusLock::ReleaseFromQueue()
+  {
+    // Called with interrupts off. 
+    s_bQueueOwns = false;
+    RunDeferred(SREG);
+  }
+
+  void CBusLock::RunDeferred( uint8_t uSREG )
+  {
+    // Called with interrupts off. Take the whole list first: handlers take 
+    // and release the lock themselves, which brings us back here. They run
+    // with interrupts restored to uSREG, and are turned off again after. 
+    uint8_t uHandlers = s_uDeferred;
+    if (uHandlers == 0)
+      return;
+
+    DeferredHandler apfnHandlers[MAX_DEFERRED];
+    for (uint8_t iHandler = 0; iHandler < uHandlers; ++iHandler)
+      apfnHandlers[iHandler] = s_apfnDeferred[iHandler];
+    s_uDeferred = 0;
+
+    SREG = uSREG;
+    for (uint8_t iHandler = 0; iHandler < uHandlers; ++iHandler)
+      apfnHandlers[iHandler]();
+    cli();
+  }
+}
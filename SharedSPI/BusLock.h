@@ -0,0 +1,75 @@
+/* *****************************************************************************
+*  Ownership of the SPI bus. Drivers hold the lock for a transfer instead of
+*  turning interrupts off for it, so interrupts that don't use the bus keep
+*  running. An interrupt handler that needs the bus while it is held asks to
+*  be run again when the lock is released (Defer). 
+*
+*  Long transfers are split into chunks of at most SHARED_SPI_MAX_LOCKED_BYTES,
+*  releasing the lock between chunks, so deferred handlers wait no longer 
+*  than one chunk. Define SHARED_SPI_MEASURE_LOCK to record the longest time
+*  the lock was held. 
+*  ***************************************************************************** */
+#pragma once
+#include <Arduino.h>
+
+#ifndef SHARED_SPI_MAX_LOCKED_BYTES
+#define SHARED_SPI_MAX_LOCKED_BYTES 64
+#endif
+
+namespace SharedSPI
+{
+  class CBusLock
+  {
+  public:
+    typedef void (*DeferredHandler)();
+
+    enum EConstants { MAX_DEFERRED = 4 };
+
+    // Takes the bus, waiting for queued transfers to finish first. Nested
+    // calls by the holder are fine. Not for interrupt handlers: they must use 
+    // TryAcquire because they can't wait for the code they interrupted. 
+    static void Acquire();
+
+    // Takes the bus if it is free. Returns false if it is in use; interrupt
+    // handlers should then Defer themselves and return. 
+    static bool TryAcquire();
+
+    static void Release();
+
+    // Runs the handler when the bus is next released. Release() runs it with
+    // interrupts as its caller had them, so the time they are off stays 
+    // bounded by SHARED_SPI_MAX_LOCKED_BYTES; the handler must take the lock
+    // itself. When the transfer queue lets go of the bus, it runs from the SPI
+    // interrupt with interrupts off. 
+    static void Defer(DeferredHandler pfnHandler);
+
+    static bool IsFree() { return s_uDepth == 0 && !s_bQueueOwns; }
+
+#ifdef SHARED_SPI_MEASURE_LOCK
+    // Longest time, in microseconds, the lock was held by code since the 
+    // last reset. Time spent by the transfer queue isn't counted. 
+    static uint32_t GetLongestHold() { return s_uLongestHold; }
+    static void ResetLongestHold() { s_uLongestHold = 0; }
+#endif
+
+  private:
+    friend class CSPITransferQueue;
+
+    // The transfer queue owns the bus between transfers it runs from the
+    // SPI interrupt. 
+    static bool TryAcquireForQueue();
+    static void ReleaseFromQueue();
+
+    static void RunDeferred(uint8_t uSREG);
+
+    static volatile uint8_t s_uDepth;
+    static volatile bool s_bQueueOwns;
+    static DeferredHandler s_apfnDeferred[MAX_DEFERRED];
+    static uint8_t s_uDeferred;
+
+#ifdef SHARED_SPI_MEASURE_LOCK
+    static uint32_t s_uAcquiredAt;
+    static uint32_t s_uLongestHold;
+#endif
+  };
+}
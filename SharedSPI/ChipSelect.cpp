@@ -0,0 +1,18 @@
+#include "ChipSelect.h"
+
+namespace SharedSPI
+{
+  CChipSelect::CChipSelect( uint8_t uPin, bool bActiveLow /*= true*/ )
+    : m_uPin(uPin)
+    , m_bActiveLow(bActiveLow)
+  {
+    m_pPort = portOutputRegister(digitalPinToPort(uPin));
+    m_uMask = digitalPinToBitMask(uPin);
+  }
+
+  void CChipSelect::Initialize() const
+  {
+    Deselect(); // Before switching to output, so the device never sees a glitch. 
+    pinMode(m_uPin, OUTPUT);
+  }
+}
@@ -0,0 +1,47 @@
+/* *****************************************************************************
+*  A chip select line for an SPI device. The pin is resolved to its port 
+*  register and bit mask once, when constructed, so selecting the device is 
+*  a couple of instructions instead of a call to digitalWrite. 
+*  ***************************************************************************** */
+#pragma once
+#include <Arduino.h>
+
+namespace SharedSPI
+{
+  class CChipSelect
+  {
+  public:
+    CChipSelect(uint8_t uPin, bool bActiveLow = true);
+
+    // Makes the pin an output and deselects the device. 
+    void Initialize() const;
+
+    void Select() const
+    {
+      Write(m_bActiveLow ? 0 : m_uMask);
+    }
+
+    void Deselect() const
+    {
+      Write(m_bActiveLow ? m_uMask : 0);
+    }
+
+    uint8_t GetPin() const { return m_uPin; }
+
+  private:
+    void Write(uint8_t uValue) const
+    {
+      // Interrupts are held off so an interrupt handler writing to another
+      // pin on the same port can't be undone. 
+      uint8_t uSREG = SREG;
+      cli();
+      *m_pPort = (*m_pPort & ~m_uMask) | uValue;
+      SREG = uSREG;
+    }
+
+    const uint8_t m_uPin;
+    const bool m_bActiveLow;
+    volatile uint8_t *m_pPort;
+    uint8_t m_uMask;
+  };
+}
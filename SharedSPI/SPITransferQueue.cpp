@@ -0,0 +1,165 @@
+#include "SPITransferQueue.h"
+#include "SharedSPI.h"
+#include "BusLock.h"
+
+namespace SharedSPI
+{
+  CSPITransfer * volatile CSPITransferQueue::s_pHead = NULL;
+  CSPITransfer *CSPITransferQueue::s_pTail = NULL;
+  uint16_t CSPITransferQueue::s_uPosition = 0;
+
+  CSPITransfer::CSPITransfer()
+  {
+    m_pDevice = NULL;
+    m_uHeaderLength = 0;
+    m_puTransmit = NULL;
+    m_puReceive = NULL;
+    m_uLength = 0;
+    m_pfnComplete = NULL;
+    m_pContext = NULL;
+    m_bBusy = false;
+    m_pNext = NULL;
+  }
+
+  void CSPITransfer::SetHeader( uint8_t uByte )
+  {
+    m_auHeader[0] = uByte;
+    m_uHeaderLength = 1;
+  }
+
+  void CSPITransfer::AddHeader( uint8_t uByte )
+  {
+    if (m_uHeaderLength < MAX_HEADER)
+      m_auHeader[m_uHeaderLength++] = uByte;
+  }
+
+  void CSPITransfer::SetData( const void *pTransmit, void *pReceive, uint16_t uLength )
+  {
+    m_puTransmit = (const uint8_t *)pTransmit;
+    m_puReceive = (uint8_t *)pReceive;
+    m_uLength = uLength;
+  }
+
+  void CSPITransfer::SetCallback( CompletionCallback pfnComplete, void *pContext /*= NULL*/ )
+  {
+    m_pfnComplete = pfnComplete;
+    m_pContext = pContext;
+  }
+
+  uint8_t CSPITransfer::NextByte( uint16_t uPosition ) const
+  {
+    if (uPosition < m_uHeaderLength)
+      return m_auHeader[uPosition];
+    return m_puTransmit != NULL ? m_puTransmit[uPosition - m_uHeaderLength] : 0;
+  }
+
+  void CSPITransferQueue::Add( CSharedSPI const *pDevice, CSPITransfer &rTransfer )
+  {
+    rTransfer.m_pDevice = pDevice;
+    rTransfer.m_pNext = NULL;
+
+    if (rTransfer.GetTotalLength() == 0)
+    {
+      if (rTransfer.m_pfnComplete != NULL)
+        rTransfer.m_pfnComplete(&rTransfer);
+      return;
+    }
+
+    uint8_t uSREG = SREG;
+    cli();
+
+    rTransfer.m_bBusy = true;
+    if (s_pHead == NULL)
+      s_pHead = &rTransfer;
+    else
+      s_pTail->m_pNext = &rTransfer;
+    s_pTail = &rTransfer;
+    StartPending();
+
+    SREG = uSREG;
+  }
+
+  void CSPITransferQueue::WaitForIdle()
+  {
+    while (s_pHead != NULL)
+    {
+      // Do the interrupt's work here when it can't. Reading SPDR after 
+      // seeing SPIF clears the flag, so the interrupt won't fire for the
+      // same byte later. 
+      if (MustPoll())
+        Poll();
+    }
+  }
+
+  void CSPITransferQueue::StartPending()
+  {
+    if (s_pHead != NULL && CBusLock::TryAcquireForQueue())
+      Start(s_pHead);
+  }
+
+  void CSPITransferQueue::Poll()
+  {
+    if (SPSR & _BV(SPIF))
+      OnByteComplete();
+  }
+
+  void CSPITransferQueue::Start( CSPITransfer *pTransfer )
+  {
+    // Interrupts are off. The SPI interrupt is only enabled while a transfer
+    // runs, so the device's cached settings still match once it is turned off. 
+    // Clear any stale flag before turning it on. 
+    pTransfer->m_pDevice->UseBus();
+    (void)SPSR;
+    (void)SPDR;
+#ifdef SHARED_SPI_QUEUE_ISR
+    SPCR |= _BV(SPIE);
+#endif
+
+    s_uPosition = 0;
+    pTransfer->m_pDevice->SelectDevice();
+    SPDR = pTransfer->NextByte(0);
+  }
+
+  void CSPITransferQueue::OnByteComplete()
+  {
+    CSPITransfer *pTransfer = s_pHead;
+    uint8_t uReceived = SPDR;
+    if (pTransfer == NULL)
+      return;
+
+    uint16_t uPosition = s_uPosition;
+    if (uPosition >= pTransfer->m_uHeaderLength && pTransfer->m_puReceive != NULL)
+      pTransfer->m_puReceive[uPosition - pTransfer->m_uHeaderLength] = uReceived;
+
+    ++uPosition;
+    if (uPosition < pTransfer->GetTotalLength())
+    {
+      s_uPosition = uPosition;
+      SPDR = pTransfer->NextByte(uPosition);
+      return;
+    }
+
+    // Finished this one. Let go of the bus between transfers so interrupt
+    // handlers waiting for it can run, then start the next. 
+    pTransfer->m_pDevice->DeselectDevice();
+    SPCR &= ~_BV(SPIE);
+    s_pHead = pTransfer->m_pNext;
+    if (s_pHead == NULL)
+      s_pTail = NULL;
+    CBusLock::ReleaseFromQueue();
+
+    pTransfer->m_pNext = NULL;
+    pTransfer->m_bBusy = false;
+    if (pTransfer->m_pfnComplete != NULL)
+      pTransfer->m_pfnComplete(pTransfer);
+
+    StartPending();
+  }
+}
+
+#ifdef SHARED_SPI_QUEUE_ISR
+ISR(SPI_STC_vect)
+{
+  SharedSPI::CSPITransferQueue::OnByteComplete();
+}
+#endif
@@ -0,0 +1,111 @@
+/* *****************************************************************************
+*  Runs SPI transfers in the background from the SPI interrupt. Each transfer
+*  is a descriptor: the device it is for, a few header bytes (command, 
+*  register or address), then a block of data sent and/or received. Transfers
+*  run one after another in the order they were queued; the bus is switched
+*  to each transfer's device as it starts. The queue takes the bus lock for
+*  each transfer, so it waits for any code using the bus to finish. 
+*
+*  Define SHARED_SPI_QUEUE_ISR to run the queue from the SPI interrupt. 
+*  Without it the library leaves SPI_STC_vect alone and transfers only 
+*  progress while WaitForIdle (or CBusLock::Acquire) polls for them. 
+*  ***************************************************************************** */
+#pragma once
+#include <Arduino.h>
+
+namespace SharedSPI
+{
+  class CSharedSPI;
+
+  class CSPITransfer
+  {
+  public:
+    // Called from the SPI interrupt when the transfer is done. 
+    typedef void (*CompletionCallback)(CSPITransfer *pTransfer);
+
+    enum EConstants { MAX_HEADER = 4 };
+
+    CSPITransfer();
+
+    // Bytes sent before the data. 
+    void SetHeader(uint8_t uByte);
+    void AddHeader(uint8_t uByte);
+
+    // Data to send (or NULL to send zeros) and buffer for data received (or 
+    // NULL to discard it). Both, if given, must hold uLength bytes. 
+    void SetData(const void *pTransmit, void *pReceive, uint16_t uLength);
+
+    void SetCallback(CompletionCallback pfnComplete, void *pContext = NULL);
+
+    // True from when the transfer is queued until it completes. The transfer
+    // and its buffers must not be changed or go out of scope while busy. 
+    bool IsBusy() const { return m_bBusy; }
+
+    void *GetContext() const { return m_pContext; }
+
+  private:
+    friend class CSPITransferQueue;
+
+    uint8_t NextByte(uint16_t uPosition) const;
+    uint16_t GetTotalLength() const { return m_uHeaderLength + m_uLength; }
+
+    CSharedSPI const *m_pDevice;
+    uint8_t m_auHeader[MAX_HEADER];
+    uint8_t m_uHeaderLength;
+    const uint8_t *m_puTransmit;
+    uint8_t *m_puReceive;
+    uint16_t m_uLength;
+    CompletionCallback m_pfnComplete;
+    void *m_pContext;
+    volatile bool m_bBusy;
+    CSPITransfer *m_pNext;
+  };
+
+  class CSPITransferQueue
+  {
+  public:
+    // Queues a transfer for the device. Use CSharedSPI::Queue. 
+    static void Add(CSharedSPI const *pDevice, CSPITransfer &rTransfer);
+
+    static bool IsIdle() { return s_pHead == NULL; }
+
+    // Waits until all queued transfers have finished. Runs them by polling
+    // when the interrupt can't (see MustPoll). Don't call while holding the
+    // bus lock; the queue can't start until it is released. 
+    static void WaitForIdle();
+
+    // True when the SPI interrupt won't run the queue: interrupts are off,
+    // or the handler isn't built. 
+    static bool MustPoll()
+    {
+#ifdef SHARED_SPI_QUEUE_ISR
+      return !(SREG & _BV(SREG_I));
+#else
+      return true;
+#endif
+    }
+
+    // Called from the SPI interrupt when a byte has been exchanged. 
+    static void OnByteComplete();
+
+  private:
+    friend class CBusLock;
+
+    // Starts the first queued transfer if the bus is free. Called with 
+    // interrupts off. 
+    static void StartPending();
+
+    // Does the interrupt's work if a byte has finished. 
+    static void Poll();
+
+    static void Start(CSPITransfer *pTransfer);
+
+    // The first transfer, which is on the bus if the queue owns the bus lock. 
+    // The rest follow through m_pNext. 
+    static CSPITransfer * volatile s_pHead;
+    static CSPITransfer *s_pTail;
+
+    // Index of the byte on the bus in the current transfer, counting the header. 
+    static uint16_t s_uPosition;
+  };
+}
@@ -1,5 +1,6 @@
 #include "SharedSPI.h"
 #include "SPI/SPI.h"
+#include "BurstTransfer.h"
 
 // This is the bit in the SPI address that marks it as a write
 #define SPI_WRITE_MASK 0x80
@@ -9,12 +10,17 @@ namespace SharedSPI
   // Last user of spi port. 
   CSharedSPI const * g_pLast = NULL;
 
+  // True once the SPI hardware and pins have been set up. 
+  bool g_bStarted = false;
+
   CSharedSPI::CSharedSPI(uint8_t uChipSelectPin
     , uint8_t uClockDivider
     , bool bActiveLow /* = true */
     , uint8_t uReadWriteFlagMask /* = 0x80 */
     , uint8_t uReadFlag /* = 0 */
     , uint8_t uWriteFlag /* = 0x80 */
+    , uint8_t uDataMode /* = SPI_MODE0 */
+    , uint8_t uBitOrder /* = MSBFIRST */
     )
     : m_uChipSelectPin(uChipSelectPin)
     , m_uClockDivider(uClockDivider)
@@ -22,9 +28,24 @@ namespace SharedSPI
     , m_uReadWriteMask(uReadWriteFlagMask)
     , m_uWriteFlag(uWriteFlag)
     , m_uReadFlag(uReadFlag)
+    , m_ChipSelect(uChipSelectPin, bActiveLow)
   {
-    pinMode(uChipSelectPin, OUTPUT);
-    DeselectDevice();
+    // Same register layout the SPI library uses in setDataMode, setBitOrder
+    // and setClockDivider. 
+    m_uSPCR = _BV(SPE) | _BV(MSTR) 
+      | (uDataMode & SPI_MODE_MASK) 
+      | (uBitOrder == LSBFIRST ? _BV(DORD) : 0) 
+      | (uClockDivider & SPI_CLOCK_MASK);
+    m_uSPSR = (uClockDivider >> 2) & SPI_2XCLOCK_MASK;
+
+    m_ChipSelect.Initialize();
+  }
+
+  void CSharedSPI::Begin() const
+  {
+    CBusLock::Acquire();
+    UseBus();
+    CBusLock::Release();
   }
 
   void CSharedSPI::Initialize() const
@@ -32,13 +53,16 @@ namespace SharedSPI
     uint8_t uSREG = SREG;
     cli();
 
-    pinMode(m_uChipSelectPin, OUTPUT);
-    DeselectDevice();
-    
-    SPI.begin();
-    SPI.setDataMode(SPI_MODE0); 
-    SPI.setBitOrder(MSBFIRST);
-    SPI.setClockDivider(m_uClockDivider);
+    if (!g_bStarted)
+    {
+      m_ChipSelect.Initialize();
+      SPI.begin();
+      g_bStarted = true;
+    }
+
+    // Switch the bus to this device's settings. 
+    SPCR = m_uSPCR;
+    SPSR = m_uSPSR;
     
     g_pLast = this; 
 
@@ -48,81 +72,101 @@ namespace SharedSPI
 
   void CSharedSPI::Write( uint8_t uRegister, uint8_t uValue ) const
   {
-    uint8_t uSREG = SREG;
-    cli();
-    if (g_pLast != this)
-      Initialize();
-
-    SelectDevice();
+    BeginTransaction();
     SPI.transfer((~m_uReadWriteMask & uRegister) | m_uWriteFlag); // Send the address with the write mask on
     SPI.transfer(uValue); // New value follows
-    DeselectDevice();
-
-
-    SREG = uSREG;
+    EndTransaction();
   }
 
   uint8_t CSharedSPI::Read( uint8_t uRegister ) const
   {
-    uint8_t uSREG = SREG;
-    cli();
-    if (g_pLast != this)
-      Initialize();
-
     uint8_t uValue;
 
-    SelectDevice();
+    BeginTransaction();
     SPI.transfer((~m_uReadWriteMask & uRegister) | m_uReadFlag); // Send the address with the write mask off
     uValue = SPI.transfer(0); // The written value is ignored, reg value is read
-    DeselectDevice();
-
+    EndTransaction();
 
-    SREG = uSREG;
     return uValue;
   }
 
-  void CSharedSPI::BurstWrite( uint8_t uFirstRegister, const void *pRawData, uint8_t uLength )
+  void CSharedSPI::BurstWrite( uint8_t uFirstRegister, const void *pRawData, uint16_t uLength )
   {
-    uint8_t const *puData = (uint8_t const*)pRawData;
-    uint8_t uSREG = SREG;
-    cli();
-    if (g_pLast != this)
-      Initialize();
+    BeginTransaction();
+    SPI.transfer((~m_uReadWriteMask & uFirstRegister) | m_uWriteFlag); // Send the start address with the write mask on
+    SendBlock((uint8_t const*)pRawData, uLength);
+    EndTransaction();
+  }
+
+  void CSharedSPI::BurstRead( uint8_t uFirstRegister, void *pRawData, uint16_t uLength ) const
+  {
+    BeginTransaction();
+    SPI.transfer((~m_uReadWriteMask & uFirstRegister) | m_uReadFlag); // Send the start address with the write mask off
+    ReceiveBlock((uint8_t *)pRawData, uLength);
+    EndTransaction();
+  }
 
+  void CSharedSPI::BeginTransaction() const
+  {
+    CBusLock::Acquire();
+    UseBus();
     SelectDevice();
-    SPI.transfer((~m_uReadWriteMask & uFirstRegister) | m_uWriteFlag); // Send the start address with the write mask on
-    while (uLength--)
-      SPI.transfer(*puData++);
+  }
+
+  void CSharedSPI::EndTransaction() const
+  {
     DeselectDevice();
+    CBusLock::Release();
+  }
 
-    SREG = uSREG;
+  void CSharedSPI::Send( const void *pData, uint16_t uLength ) const
+  {
+    SendBlock((uint8_t const*)pData, uLength);
   }
 
-  void CSharedSPI::BurstRead( uint8_t uFirstRegister, void *pRawData, uint8_t uLength ) const
+  void CSharedSPI::Receive( void *pData, uint16_t uLength ) const
+  {
+    ReceiveBlock((uint8_t *)pData, uLength);
+  }
+
+  void CSharedSPI::InvalidateSettings()
+  {
+    g_pLast = NULL;
+  }
+
+  void CSharedSPI::UseBus() const
   {
-    uint8_t *puData = (uint8_t *)pRawData;
-    uint8_t uSREG = SREG;
-    cli();
     if (g_pLast != this)
       Initialize();
+  }
 
-    SelectDevice();
-    SPI.transfer((~m_uReadWriteMask & uFirstRegister) | m_uReadFlag); // Send the start address with the write mask off
-    while (uLength--)
-      *puData++ = SPI.transfer(0);
-    DeselectDevice();
+  void CSharedSPI::QueueBurstWrite( CSPITransfer &rTransfer, uint8_t uFirstRegister, const void *pData, uint16_t uLength ) const
+  {
+    rTransfer.SetHeader((~m_uReadWriteMask & uFirstRegister) | m_uWriteFlag);
+    rTransfer.SetData(pData, NULL, uLength);
+    Queue(rTransfer);
+  }
 
-    SREG = uSREG;
+  void CSharedSPI::QueueBurstRead( CSPITransfer &rTransfer, uint8_t uFirstRegister, void *pData, uint16_t uLength ) const
+  {
+    rTransfer.SetHeader((~m_uReadWriteMask & uFirstRegister) | m_uReadFlag);
+    rTransfer.SetData(NULL, pData, uLength);
+    Queue(rTransfer);
+  }
+
+  void CSharedSPI::Queue( CSPITransfer &rTransfer ) const
+  {
+    CSPITransferQueue::Add(this, rTransfer);
   }
 
   void CSharedSPI::DeselectDevice() const
   {
-    digitalWrite(m_uChipSelectPin, m_bActiveLow ? HIGH : LOW);
+    m_ChipSelect.Deselect();
   }
 
   void CSharedSPI::SelectDevice() const
   {
-    digitalWrite(m_uChipSelectPin, m_bActiveLow ? LOW : HIGH);
+    m_ChipSelect.Select();
   }
 
 }
\ No newline at end of file
@@ -3,6 +3,10 @@
 *  ***************************************************************************** */
 #pragma once
 #include <Arduino.h>
+#include "SPI/SPI.h"
+#include "ChipSelect.h"
+#include "SPITransferQueue.h"
+#include "BusLock.h"
 
 namespace SharedSPI
 {
@@ -16,17 +20,77 @@ namespace SharedSPI
     const uint8_t m_uReadFlag;
     const uint8_t m_uWriteFlag;
 
+    // uDataMode is one of SPI_MODE0..3; uBitOrder is MSBFIRST or LSBFIRST. 
     CSharedSPI(uint8_t uChipSelectPin, uint8_t uClockDivider, 
-      bool bActiveLow = true, uint8_t uReadWriteFlagMask = 0x80, uint8_t uReadFlag = 0, uint8_t uWriteFlag = 0x80);
-    void Initialize() const;
+      bool bActiveLow = true, uint8_t uReadWriteFlagMask = 0x80, uint8_t uReadFlag = 0, uint8_t uWriteFlag = 0x80,
+      uint8_t uDataMode = SPI_MODE0, uint8_t uBitOrder = MSBFIRST);
+
+    // Sets the bus up for this device; call from the driver's begin(). Takes 
+    // the bus lock, so it waits for queued transfers rather than changing the
+    // SPI registers under them. 
+    void Begin() const;
 
     void Write(uint8_t uRegister, uint8_t uValue) const;
     uint8_t Read(uint8_t uRegister) const;
-    void BurstWrite(uint8_t uFirstRegister, const void *pData, uint8_t uLength);
-    void BurstRead(uint8_t uFirstRegister, void *pData, uint8_t uLength) const;
+    void BurstWrite(uint8_t uFirstRegister, const void *pData, uint16_t uLength);
+    void BurstRead(uint8_t uFirstRegister, void *pData, uint16_t uLength) const;
+
+    // For devices that don't fit the register model. Between Begin and End 
+    // the bus is locked, set up for this device and the device is selected. 
+    void BeginTransaction() const;
+    void EndTransaction() const;
+    uint8_t Transfer(uint8_t uData) const { return SPI.transfer(uData); }
+    void Send(const void *pData, uint16_t uLength) const;
+    void Receive(void *pData, uint16_t uLength) const;
+
+    // Call after changing the SPI settings without going through a 
+    // CSharedSPI, so the next device to use the bus reloads its settings. 
+    static void InvalidateSettings();
+
+    // Background transfers, run from the SPI interrupt when 
+    // SHARED_SPI_QUEUE_ISR is defined, otherwise by polling (see 
+    // CSPITransferQueue). The transfer's header is set to the register 
+    // address; the data must stay in scope until the transfer is no longer busy. 
+    void QueueBurstWrite(CSPITransfer &rTransfer, uint8_t uFirstRegister, const void *pData, uint16_t uLength) const;
+    void QueueBurstRead(CSPITransfer &rTransfer, uint8_t uFirstRegister, void *pData, uint16_t uLength) const;
+
+    // Queues a transfer with a header set up by the caller. 
+    void Queue(CSPITransfer &rTransfer) const;
 
   private:
+    friend class CSPITransferQueue;
+
+    // Loads this device's settings unless it was the last to use the bus. 
+    // The bus lock must be held. 
+    void UseBus() const;
+
+    // Loads this device's settings. Only the first call starts the SPI 
+    // hardware; after that switching devices only loads the SPI control and
+    // status registers. Only for UseBus. 
+    void Initialize() const;
+
     void SelectDevice() const;
     void DeselectDevice() const;
+
+    CChipSelect m_ChipSelect;
+
+    // SPI control and status register values for this device, worked out once. 
+    uint8_t m_uSPCR;
+    uint8_t m_uSPSR;
   };
+
+#ifdef SHAREDSPI_MEASURE
+  // Define SHAREDSPI_MEASURE to build on-target benchmarks of the bus code.
+  // Times switching the bus to rDevice the old way (SPI.begin,
+  // setDataMode, setBitOrder, setClockDivider) against loading its cached
+  // SPCR and SPSR values, printing microseconds per call. rDevice should use
+  // SPI_MODE0 and MSBFIRST so both set up the same thing.
+  void RunSettingsBenchmark(Print &rOut, const CSharedSPI &rDevice, uint16_t uIterations = 1000);
+
+  // Compares SendBlock and ReceiveBlock with a byte at a time SPI.transfer
+  // loop, printing bytes per second and the percentage of the 
+  // SPI_CLOCK_DIV2 wire rate. Uses rDevice's settings, so give it 
+  // SPI_CLOCK_DIV2, but selects no device. 
+  void RunBlockBenchmark(Print &rOut, const CSharedSPI &rDevice, uint16_t uRounds = 100);
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,122 @@
+/* *****************************************************************************
+*  On-target benchmarks for the shared SPI bus. Only built when
+*  SHAREDSPI_MEASURE is defined.
+*  ***************************************************************************** */
+#include "SharedSPI.h"
+#include "BurstTransfer.h"
+
+#ifdef SHAREDSPI_MEASURE
+
+namespace SharedSPI
+{
+  static void PrintTiming( Print &rOut, const __FlashStringHelper *pName, uint32_t uElapsed, uint16_t uIterations )
+  {
+    rOut.print(pName);
+    rOut.print(F(", "));
+    rOut.println(uIterations != 0 ? (double)uElapsed / uIterations : 0.0, 2);
+  }
+
+  void RunSettingsBenchmark( Print &rOut, const CSharedSPI &rDevice, uint16_t uIterations /*= 1000*/ )
+  {
+    // Hold the bus so nothing else changes the settings part way through.
+    CBusLock::Acquire();
+    rDevice.Begin();
+    const uint8_t uSPCR = SPCR;
+    const uint8_t uSPSR = SPSR;
+
+    rOut.println(F("Operation, us/call"));
+
+    // What switching devices did before the settings were cached.
+    uint32_t uStart = micros();
+    for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    {
+      SPI.begin();
+      SPI.setDataMode(SPI_MODE0);
+      SPI.setBitOrder(MSBFIRST);
+      SPI.setClockDivider(rDevice.m_uClockDivider);
+    }
+    PrintTiming(rOut, F("SPI.begin + set mode/order/divider"), micros() - uStart, uIterations);
+
+    uStart = micros();
+    for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    {
+      SPI.setDataMode(SPI_MODE0);
+      SPI.setBitOrder(MSBFIRST);
+      SPI.setClockDivider(rDevice.m_uClockDivider);
+    }
+    PrintTiming(rOut, F("set mode/order/divider"), micros() - uStart, uIterations);
+
+    uStart = micros();
+    for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    {
+      SPCR = uSPCR;
+      SPSR = uSPSR;
+    }
+    PrintTiming(rOut, F("Load cached SPCR/SPSR"), micros() - uStart, uIterations);
+
+    // The whole switch as drivers see it, lock included.
+    uStart = micros();
+    for (uint16_t iIteration = 0; iIteration < uIterations; ++iIteration)
+    {
+      CSharedSPI::InvalidateSettings();
+      rDevice.Begin();
+    }
+    PrintTiming(rOut, F("InvalidateSettings + Begin"), micros() - uStart, uIterations);
+
+    CSharedSPI::InvalidateSettings();
+    CBusLock::Release();
+  }
+
+  static void PrintRate( Print &rOut, const __FlashStringHelper *pName, uint32_t uBytes, uint32_t uElapsed )
+  {
+    // At SPI_CLOCK_DIV2 a byte takes 16 CPU clocks on the wire. 
+    const double dMaxRate = F_CPU / 16.0;
+    double dRate = uElapsed != 0 ? uBytes * 1000000.0 / uElapsed : 0.0;
+    rOut.print(pName);
+    rOut.print(F(", "));
+    rOut.print(dRate, 0);
+    rOut.print(F(", "));
+    rOut.println(dRate * 100.0 / dMaxRate, 1);
+  }
+
+  void RunBlockBenchmark( Print &rOut, const CSharedSPI &rDevice, uint16_t uRounds /*= 100*/ )
+  {
+    uint8_t auBuffer[SHARED_SPI_MAX_LOCKED_BYTES];
+    for (uint16_t iByte = 0; iByte < sizeof(auBuffer); ++iByte)
+      auBuffer[iByte] = iByte;
+    const uint32_t uBytes = (uint32_t)uRounds * sizeof(auBuffer);
+
+    // Only the settings are used: no device is selected, so nothing sees 
+    // the data. 
+    CBusLock::Acquire();
+    rDevice.Begin();
+
+    rOut.println(F("Method, bytes/s, % of SPI_CLOCK_DIV2 rate"));
+
+    uint32_t uStart = micros();
+    for (uint16_t iRound = 0; iRound < uRounds; ++iRound)
+      for (uint16_t iByte = 0; iByte < sizeof(auBuffer); ++iByte)
+        SPI.transfer(auBuffer[iByte]);
+    PrintRate(rOut, F("SPI.transfer send"), uBytes, micros() - uStart);
+
+    uStart = micros();
+    for (uint16_t iRound = 0; iRound < uRounds; ++iRound)
+      SendBlock(auBuffer, sizeof(auBuffer));
+    PrintRate(rOut, F("SendBlock"), uBytes, micros() - uStart);
+
+    uStart = micros();
+    for (uint16_t iRound = 0; iRound < uRounds; ++iRound)
+      for (uint16_t iByte = 0; iByte < sizeof(auBuffer); ++iByte)
+        auBuffer[iByte] = SPI.transfer(0);
+    PrintRate(rOut, F("SPI.transfer receive"), uBytes, micros() - uStart);
+
+    uStart = micros();
+    for (uint16_t iRound = 0; iRound < uRounds; ++iRound)
+      ReceiveBlock(auBuffer, sizeof(auBuffer));
+    PrintRate(rOut, F("ReceiveBlock"), uBytes, micros() - uStart);
+
+    CBusLock::Release();
+  }
+}
+
+#endif
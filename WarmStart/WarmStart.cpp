@@ -0,0 +1,15 @@
+#include "WarmStart.h"
+#include "avr/crc16.h"
+
+namespace WarmStart
+{
+  uint16_t Checksum( const void *pData, uint8_t uLength )
+  {
+    // Seeded so that all zeros (or all ones) is never a valid snapshot. 
+    const uint8_t *puData = (const uint8_t *)pData;
+    uint16_t uCRC = 0x5a5a;
+    while (uLength--)
+      uCRC = _crc16_update(uCRC, *puData++);
+    return uCRC;
+  }
+}
@@ -0,0 +1,38 @@
+/* *****************************************************************************
+*  Keeps driver state in RAM across a watchdog or external reset so drivers 
+*  can skip reconfiguring hardware that is already set up. Snapshots live in 
+*  the .noinit section, which start-up code leaves alone, and carry a CRC so
+*  the random contents left after power-up are rejected. 
+*  ***************************************************************************** */
+#pragma once
+#include <Arduino.h>
+
+// Place a snapshot in RAM that isn't cleared at start-up. Only for 
+// variables at file scope. 
+#define WARM_START_NOINIT __attribute__((section(".noinit")))
+
+namespace WarmStart
+{
+  uint16_t Checksum(const void *pData, uint8_t uLength);
+
+  template <class T> struct Snapshot
+  {
+    T m_Data;
+    uint16_t m_uChecksum;
+
+    bool IsValid() const
+    {
+      return m_uChecksum == Checksum(&m_Data, sizeof(m_Data));
+    }
+
+    void Save()
+    {
+      m_uChecksum = Checksum(&m_Data, sizeof(m_Data));
+    }
+
+    void Invalidate()
+    {
+      m_uChecksum = ~Checksum(&m_Data, sizeof(m_Data));
+    }
+  };
+}